@@ -4,9 +4,12 @@
 // (but note, that the led-matrix library this depends on is GPL v2)
 
 #include "led-matrix.h"
+#include "content-stream.h"
 #include "threaded-canvas-manipulator.h"
+#include "virtual-display.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
@@ -69,13 +72,15 @@ private:
  */
 
 // Simple generator that pulses through RGB and White.
+// Steps with the display refresh, so the color changes evenly.
 class ColorPulseGenerator : public ThreadedCanvasManipulator {
 public:
-  ColorPulseGenerator(Canvas *m) : ThreadedCanvasManipulator(m) {}
+  ColorPulseGenerator(Canvas *m, RGBMatrix *matrix)
+    : ThreadedCanvasManipulator(m), matrix_(matrix) {}
   void Run() {
     uint32_t continuum = 0;
     while (running()) {
-      usleep(5 * 1000);
+      matrix_->WaitForRefreshes(1);
       continuum += 1;
       continuum %= 3 * 255;
       int r = 0, g = 0, b = 0;
@@ -95,6 +100,9 @@ public:
       canvas()->Fill(r, g, b);
     }
   }
+
+private:
+  RGBMatrix *const matrix_;
 };
 
 class SimpleSquare : public ThreadedCanvasManipulator {
@@ -130,14 +138,15 @@ public:
     const int y_step = max(1, height / sub_blocks);
     uint8_t count = 0;
     while (running()) {
-      for (int y = 0; y < height; ++y) {
-        for (int x = 0; x < width; ++x) {
-          int c = sub_blocks * (y / y_step) + x / x_step;
+      for (int y = 0; y < height; y += y_step) {
+        for (int x = 0; x < width; x += x_step) {
+          uint8_t c = sub_blocks * (y / y_step) + x / x_step;
+          const int w = min(x_step, width - x), h = min(y_step, height - y);
           switch (count % 4) {
-          case 0: canvas()->SetPixel(x, y, c, c, c); break;
-          case 1: canvas()->SetPixel(x, y, c, 0, 0); break;
-          case 2: canvas()->SetPixel(x, y, 0, c, 0); break;
-          case 3: canvas()->SetPixel(x, y, 0, 0, c); break;
+          case 0: canvas()->FillRect(x, y, w, h, c, c, c); break;
+          case 1: canvas()->FillRect(x, y, w, h, c, 0, 0); break;
+          case 2: canvas()->FillRect(x, y, w, h, 0, c, 0); break;
+          case 3: canvas()->FillRect(x, y, w, h, 0, 0, c); break;
           }
         }
       }
@@ -212,9 +221,14 @@ class ImageScroller : public ThreadedCanvasManipulator {
 public:
   // Scroll image with "scroll_jumps" pixels every "scroll_ms" milliseconds.
   // If "scroll_ms" is negative, don't do any scrolling.
-  ImageScroller(Canvas *m, int scroll_jumps, int scroll_ms = 30)
+  // If "matrix" is given and the image is at least as wide, the image is
+  // put on a scroll canvas of the matrix once, and scrolling only moves
+  // the window over it. With a "matrix", each step is also recorded if it
+  // is recording, see RGBMatrix::SetRecorder().
+  ImageScroller(Canvas *m, int scroll_jumps, int scroll_ms = 30,
+                RGBMatrix *matrix = NULL)
     : ThreadedCanvasManipulator(m), scroll_jumps_(scroll_jumps),
-      scroll_ms_(scroll_ms),
+      scroll_ms_(scroll_ms), matrix_(matrix), window_(NULL), plain_(NULL),
       horizontal_position_(0) {
   }
 
@@ -268,25 +282,36 @@ public:
     const int screen_height = canvas()->height();
     const int screen_width = canvas()->width();
     while (running()) {
+      bool swapped = false;   // Then the swap already recorded the frame.
       {
         MutexLock l(&mutex_new_image_);
         if (new_image_.IsValid()) {
           current_image_.Delete();
           current_image_ = new_image_;
           new_image_.Reset();
+          swapped = (matrix_ != NULL && current_image_.width >= screen_width
+                     && ShowInWindow(screen_height));
+          if (!swapped)
+            LeaveWindow();
         }
       }
       if (!current_image_.IsValid()) {
         usleep(100 * 1000);
         continue;
       }
-      for (int x = 0; x < screen_width; ++x) {
-        for (int y = 0; y < screen_height; ++y) {
-          const Pixel &p = current_image_.getPixel(
-                     (horizontal_position_ + x) % current_image_.width, y);
-          canvas()->SetPixel(x, y, p.red, p.green, p.blue);
+      if (window_ != NULL) {
+        window_->SetScrollOffset(horizontal_position_, 0);
+      } else {
+        for (int x = 0; x < screen_width; ++x) {
+          for (int y = 0; y < screen_height; ++y) {
+            const Pixel &p = current_image_.getPixel(
+                       (horizontal_position_ + x) % current_image_.width, y);
+            canvas()->SetPixel(x, y, p.red, p.green, p.blue);
+          }
         }
       }
+      if (matrix_ != NULL && !swapped)
+        matrix_->RecordFrame();
       horizontal_position_ += scroll_jumps_;
       if (horizontal_position_ < 0) horizontal_position_ = current_image_.width;
       if (scroll_ms_ <= 0) {
@@ -323,6 +348,40 @@ private:
     Pixel *image;
   };
 
+  // Put the whole current image on a scroll canvas as wide as the image
+  // and display that. A window of another width is replaced, and freed
+  // once it is off the display. Returns false if there is no window for
+  // the image.
+  bool ShowInWindow(int height) {
+    FrameCanvas *window = window_;
+    if (window == NULL || window->width() != current_image_.width) {
+      window = matrix_->CreateScrollCanvas(current_image_.width, height);
+      if (window == NULL) return false;
+    }
+    window->Clear();
+    window->SetScrollOffset(horizontal_position_, 0);
+    window->SetPixels(0, 0, current_image_.width,
+                      min(height, current_image_.height),
+                      (const uint8_t *) current_image_.image,
+                      current_image_.width * sizeof(Pixel));
+    FrameCanvas *const previous = matrix_->SwapOnVSync(window);
+    if (window_ == NULL)
+      plain_ = previous;   // What we draw onto without a window.
+    else if (window_ != window)
+      matrix_->DeleteFrameCanvas(window_);
+    window_ = window;
+    return true;
+  }
+
+  // Back to drawing pixel by pixel: show the canvas the matrix draws onto
+  // again and free the scroll window.
+  void LeaveWindow() {
+    if (window_ == NULL) return;
+    matrix_->SwapOnVSync(plain_);
+    matrix_->DeleteFrameCanvas(window_);
+    window_ = NULL;
+  }
+
   // Read line, skip comments.
   char *ReadLine(FILE *f, char *buffer, size_t len) {
     char *result;
@@ -334,6 +393,9 @@ private:
 
   const int scroll_jumps_;
   const int scroll_ms_;
+  RGBMatrix *const matrix_;
+  FrameCanvas *window_;
+  FrameCanvas *plain_;    // Displayed before the window.
 
   // Current image is only manipulated in our thread.
   Image current_image_;
@@ -804,9 +866,7 @@ public:
 
 private:
   void drawBarRow(int bar, uint8_t y, uint8_t r, uint8_t g, uint8_t b) {
-    for (uint8_t x=bar*barWidth_; x<(bar+1)*barWidth_; ++x) {
-      canvas()->SetPixel(x, height_-1-y, r, g, b);
-    }
+    canvas()->FillRect(bar*barWidth_, height_-1-y, barWidth_, 1, r, g, b);
   }
 
   int delay_ms_;
@@ -823,23 +883,92 @@ private:
   int t_;
 };
 
+// Plays a recording made with -O, over and over.
+class StreamPlayback : public ThreadedCanvasManipulator {
+public:
+  StreamPlayback(Canvas *m, int fd)
+    : ThreadedCanvasManipulator(m), fd_(fd), reader_(fd) {}
+  virtual ~StreamPlayback() {
+    Stop();
+    WaitStopped();   // only now it is safe to close the file.
+    close(fd_);
+  }
+
+  bool ok() const { return reader_.ok(); }
+
+  void Run() {
+    StreamPlayer player(&reader_);
+    while (running()) {
+      if (player.ShowNext(canvas()))
+        continue;
+      // End of the recording: start over, unless there is nothing to show.
+      if (!player.Rewind() || !player.ShowNext(canvas()))
+        break;
+    }
+  }
+
+private:
+  const int fd_;
+  StreamReader reader_;
+};
+
+// Most demos draw straight onto the matrix, so nobody tells it when a frame
+// is complete. This samples what is displayed at a steady rate instead.
+class DisplayRecorder : public ThreadedCanvasManipulator {
+public:
+  DisplayRecorder(RGBMatrix *matrix, int fps)
+    : ThreadedCanvasManipulator(matrix), matrix_(matrix), fps_(fps) {}
+  virtual ~DisplayRecorder() {
+    Stop();
+    WaitStopped();
+  }
+
+  void Run() {
+    while (running()) {
+      matrix_->RecordFrame();
+      usleep(1000000 / fps_);
+    }
+  }
+
+private:
+  RGBMatrix *const matrix_;
+  const int fps_;
+};
+
 static int usage(const char *progname) {
   fprintf(stderr, "usage: %s <options> -D <demo-nr> [optional parameter]\n",
           progname);
   fprintf(stderr, "Options:\n"
-          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32. "
-          "Default: 32\n"
+          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32, 64 for\n"
+          "\t                64x64 (which count as 2 chained). Default: 32\n"
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
+          "\t-n <parallel> : Parallel chains (1..3), stacked vertically.\n"
+          "\t                Default: 1.\n"
           "\t-L            : 'Large' display, composed out of 4 times 32x32\n"
           "\t-p <pwm-bits> : Bits used for PWM. Something between 1..11\n"
+          "\t-T <bits>     : Temporal dithering: recover up to this many\n"
+          "\t                bits (0..4) of what -p leaves out.\n"
           "\t-l            : Don't do luminance correction (CIE1931)\n"
+          "\t-g <gamma>    : Power gamma response instead of CIE1931\n"
+          "\t-b <percent>  : Brightness, 0..100 percent of full on-time.\n"
+          "\t                Default: 100.\n"
+          "\t-P            : Pipelined output: shift next plane while lit\n"
+          "\t-R <min-hz>   : Reduce PWM bits as needed to refresh at least\n"
+          "\t                this often.\n"
           "\t-D <demo-nr>  : Always needs to be set\n"
           "\t-d            : run as daemon. Use this when starting in\n"
           "\t                /etc/init.d, but also when running without\n"
           "\t                terminal (e.g. cron).\n"
           "\t-t <seconds>  : Run for these number of seconds, then exit.\n"
           "\t       (if neither -d nor -t are supplied, waits for <RETURN>)\n"
-          "\t-w <count>    : Wait states (to throttle I/O speed)\n");
+          "\t-w <count>    : Wait states (to throttle I/O speed)\n"
+          "\t-a <cpu>      : Run the refresh thread on this CPU only\n"
+          "\t-O <file>     : Record what is displayed into this file\n"
+          "\t-V <output>   : No panels needed: show what they would in the\n"
+          "\t                terminal (-V term) or write PPM images to a\n"
+          "\t                file ('-': stdout; a %%d in the name makes a\n"
+          "\t                file per frame), and report CPU per frame.\n"
+          "\t-f <fps>      : Frames per second of -V. Default: 30\n");
   fprintf(stderr, "Demos, choosen with -D\n");
   fprintf(stderr, "\t0  - some rotating square\n"
           "\t1  - forward scrolling an image (-m <scroll-ms>)\n"
@@ -850,7 +979,8 @@ static int usage(const char *progname) {
           "\t6  - Abelian sandpile model (-m <time-step-ms>)\n"
           "\t7  - Conway's game of life (-m <time-step-ms>)\n"
           "\t8  - Langton's ant (-m <time-step-ms>)\n"
-          "\t9  - Volume bars (-m <time-step-ms>)\n");
+          "\t9  - Volume bars (-m <time-step-ms>)\n"
+          "\t10 - Play a recording made with -O (parameter: the file)\n");
   fprintf(stderr, "Example:\n\t%s -t 10 -D 1 runtext.ppm\n"
           "Scrolls the runtext for 10 seconds\n", progname);
   return 1;
@@ -862,16 +992,27 @@ int main(int argc, char *argv[]) {
   int demo = -1;
   int rows = 32;
   int chain = 1;
+  int parallel = 1;
   int scroll_ms = 30;
   int pwm_bits = -1;
+  int dither_bits = 0;
   bool large_display = false;
   bool do_luminance_correct = true;
+  float gamma = 0;
+  bool pipelined_output = false;
+  int min_refresh_rate = 0;
+  int brightness = 100;
+  int refresh_cpu = -1;
   uint8_t w = 0; // Use default # of write cycles
+  const char *record_file = NULL;
+  const char *virtual_output = NULL;
+  int virtual_fps = 30;
 
   const char *demo_parameter = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "dlD:t:r:p:c:m:w:L")) != -1) {
+  while ((opt = getopt(argc, argv,
+                       "dlPD:t:r:p:c:n:m:w:R:b:T:g:La:O:V:f:")) != -1) {
     switch (opt) {
     case 'D':
       demo = atoi(optarg);
@@ -893,6 +1034,10 @@ int main(int argc, char *argv[]) {
       chain = atoi(optarg);
       break;
 
+    case 'n':
+      parallel = atoi(optarg);
+      break;
+
     case 'm':
       scroll_ms = atoi(optarg);
       break;
@@ -901,10 +1046,30 @@ int main(int argc, char *argv[]) {
       pwm_bits = atoi(optarg);
       break;
 
+    case 'T':
+      dither_bits = atoi(optarg);
+      break;
+
     case 'l':
       do_luminance_correct = !do_luminance_correct;
       break;
 
+    case 'g':
+      gamma = atof(optarg);
+      break;
+
+    case 'P':
+      pipelined_output = true;
+      break;
+
+    case 'R':
+      min_refresh_rate = atoi(optarg);
+      break;
+
+    case 'b':
+      brightness = atoi(optarg);
+      break;
+
     case 'L':
       // The 'large' display assumes a chain of four displays with 32x32
       chain = 4;
@@ -916,6 +1081,22 @@ int main(int argc, char *argv[]) {
       w = atoi(optarg);
       break;
 
+    case 'a':
+      refresh_cpu = atoi(optarg);
+      break;
+
+    case 'O':
+      record_file = optarg;
+      break;
+
+    case 'V':
+      virtual_output = optarg;
+      break;
+
+    case 'f':
+      virtual_fps = atoi(optarg);
+      break;
+
     default: /* '?' */
       return usage(argv[0]);
     }
@@ -930,14 +1111,14 @@ int main(int argc, char *argv[]) {
     return usage(argv[0]);
   }
 
-  if (getuid() != 0) {
+  if (virtual_output == NULL && getuid() != 0) {
     fprintf(stderr, "Must run as root to be able to access /dev/mem\n"
             "Prepend 'sudo' to the command:\n\tsudo %s ...\n", argv[0]);
     return 1;
   }
 
-  if (rows != 16 && rows != 32) {
-    fprintf(stderr, "Rows can either be 16 or 32\n");
+  if (rows != 16 && rows != 32 && rows != 64) {
+    fprintf(stderr, "Rows can either be 16, 32 or 64\n");
     return 1;
   }
 
@@ -945,16 +1126,54 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Chain outside usable range\n");
     return 1;
   }
-  if (chain > 8) {
-    fprintf(stderr, "That is a long chain. Expect some flicker.\n");
+  if (parallel < 1 || parallel > 3) {
+    fprintf(stderr, "Parallel chains can be 1..3\n");
+    return 1;
+  }
+  if (chain > 8 && min_refresh_rate == 0) {
+    fprintf(stderr, "That is a long chain. Expect some flicker "
+            "(or use -R).\n");
+  }
+
+  if (virtual_fps < 1) {
+    fprintf(stderr, "Frames per second need to be positive\n");
+    return 1;
   }
 
   // Initialize GPIO pins. This might fail when we don't have permissions.
   GPIO io;
-  if (!io.Init())
+  if (virtual_output == NULL && !io.Init())
     return 1;
   if(w) io.writeCycles = w;
 
+  // Or emulate the panels.
+  VirtualDisplay *virtual_display = NULL;
+  int virtual_fd = -1;
+  if (virtual_output != NULL && strcmp(virtual_output, "term") == 0) {
+    virtual_display = new VirtualDisplay(STDOUT_FILENO,
+                                         VirtualDisplay::kTerminal,
+                                         virtual_fps);
+  } else if (virtual_output != NULL && strcmp(virtual_output, "-") == 0) {
+    virtual_display = new VirtualDisplay(STDOUT_FILENO, VirtualDisplay::kPPM,
+                                         virtual_fps);
+  } else if (virtual_output != NULL && strchr(virtual_output, '%') != NULL) {
+    virtual_display = new VirtualDisplay(virtual_output, virtual_fps);
+    if (!virtual_display->ok()) {
+      fprintf(stderr, "%s: needs exactly one %%d for the frame number\n",
+              virtual_output);
+      return 1;
+    }
+  } else if (virtual_output != NULL) {
+    virtual_fd = open(virtual_output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (virtual_fd < 0) {
+      perror(virtual_output);
+      return 1;
+    }
+    virtual_display = new VirtualDisplay(virtual_fd, VirtualDisplay::kPPM,
+                                         virtual_fps);
+  }
+  const bool wait_for_return = !as_daemon && runtime_seconds <= 0;
+
   // Start daemon before we start any threads.
   if (as_daemon) {
     if (fork() != 0)
@@ -965,12 +1184,46 @@ int main(int argc, char *argv[]) {
   }
 
   // The matrix, our 'frame buffer' and display updater.
-  RGBMatrix *matrix = new RGBMatrix(&io, rows, chain);
+  RGBMatrix *matrix = new RGBMatrix(NULL, rows, chain, parallel);
+  if (virtual_display != NULL) {
+    // Printed now, the terminal display redraws below it.
+    if (wait_for_return)
+      fprintf(stderr, "Press <RETURN> to exit\n");
+    matrix->SetVirtualDisplay(virtual_display);
+  } else {
+    ThreadOptions refresh_options;
+    refresh_options.policy = SCHED_FIFO;
+    refresh_options.priority = 99;
+    refresh_options.cpu = refresh_cpu;
+    refresh_options.name = "rgb-refresh";
+    refresh_options.lock_memory = true;
+    matrix->SetRefreshThreadOptions(refresh_options);
+    matrix->SetGPIO(&io);
+  }
   matrix->set_luminance_correct(do_luminance_correct);
+  if (gamma != 0) {
+    ResponseCurve curve(ResponseCurve::kGamma);
+    curve.gamma = gamma;
+    if (!matrix->SetResponseCurve(curve)) {
+      fprintf(stderr, "Gamma needs to be positive\n");
+      return 1;
+    }
+  }
+  matrix->set_pipelined_output(pipelined_output);
+  matrix->set_min_refresh_rate(min_refresh_rate);
+  if (brightness < 0 || brightness > 100
+      || !matrix->SetBrightness(brightness)) {
+    fprintf(stderr, "Brightness outside 0..100\n");
+    return 1;
+  }
   if (pwm_bits >= 0 && !matrix->SetPWMBits(pwm_bits)) {
     fprintf(stderr, "Invalid range of pwm-bits\n");
     return 1;
   }
+  if (dither_bits < 0 || !matrix->SetDitherBits(dither_bits)) {
+    fprintf(stderr, "Dither bits outside 0..4\n");
+    return 1;
+  }
 
   Canvas *canvas = matrix;
 
@@ -982,6 +1235,7 @@ int main(int argc, char *argv[]) {
   // The ThreadedCanvasManipulator objects are filling
   // the matrix continuously.
   ThreadedCanvasManipulator *image_gen = NULL;
+  bool records_frames = false;   // Or what's displayed is sampled.
   switch (demo) {
   case 0:
     image_gen = new RotatingBlockGenerator(canvas);
@@ -992,10 +1246,13 @@ int main(int argc, char *argv[]) {
     if (demo_parameter) {
       ImageScroller *scroller = new ImageScroller(canvas,
                                                   demo == 1 ? 1 : -1,
-                                                  scroll_ms);
+                                                  scroll_ms,
+                                                  large_display
+                                                  ? NULL : matrix);
       if (!scroller->LoadPPM(demo_parameter))
         return 1;
       image_gen = scroller;
+      records_frames = !large_display;
     } else {
       fprintf(stderr, "Demo %d Requires PPM image as parameter\n", demo);
       return 1;
@@ -1007,7 +1264,7 @@ int main(int argc, char *argv[]) {
     break;
 
   case 4:
-    image_gen = new ColorPulseGenerator(canvas);
+    image_gen = new ColorPulseGenerator(canvas, matrix);
     break;
 
   case 5:
@@ -1029,11 +1286,50 @@ int main(int argc, char *argv[]) {
   case 9:
     image_gen = new VolumeBars(canvas, scroll_ms, canvas->width()/2);
     break;
+
+  case 10:
+    if (demo_parameter) {
+      const int fd = open(demo_parameter, O_RDONLY);
+      if (fd < 0) {
+        perror(demo_parameter);
+        return 1;
+      }
+      StreamPlayback *playback = new StreamPlayback(canvas, fd);
+      if (!playback->ok()) {
+        fprintf(stderr, "%s is not a recording\n", demo_parameter);
+        return 1;
+      }
+      image_gen = playback;
+    } else {
+      fprintf(stderr, "Demo %d Requires a recording as parameter\n", demo);
+      return 1;
+    }
+    break;
   }
 
   if (image_gen == NULL)
     return usage(argv[0]);
 
+  // Recording what is displayed. The recorder writes from a thread of its
+  // own, so it doesn't disturb the refresh or the demo.
+  int record_fd = -1;
+  StreamRecorder *recorder = NULL;
+  DisplayRecorder *sampler = NULL;
+  if (record_file) {
+    record_fd = open(record_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (record_fd < 0) {
+      perror(record_file);
+      return 1;
+    }
+    recorder = new StreamRecorder(record_fd, matrix->width(),
+                                  matrix->height());
+    matrix->SetRecorder(recorder);
+    if (!records_frames) {
+      sampler = new DisplayRecorder(matrix, 30);
+      sampler->Start();
+    }
+  }
+
   // Image generating demo is crated. Now start the thread.
   image_gen->Start();
 
@@ -1042,17 +1338,30 @@ int main(int argc, char *argv[]) {
   // waiting for one of the conditions to exit.
   if (as_daemon) {
     sleep(runtime_seconds > 0 ? runtime_seconds : INT_MAX);
-  } else if (runtime_seconds > 0) {
+  } else if (!wait_for_return) {
     sleep(runtime_seconds);
   } else {
     // Things are set up. Just wait for <RETURN> to be pressed.
-    printf("Press <RETURN> to exit and reset LEDs\n");
+    if (virtual_display == NULL)
+      printf("Press <RETURN> to exit and reset LEDs\n");
     getchar();
   }
 
   // Stop image generating thread.
   delete image_gen;
+  delete sampler;
   delete canvas;
+  // Nothing is recording anymore; write out what's left.
+  delete recorder;
+  if (record_fd >= 0)
+    close(record_fd);
+  // The matrix is gone, so is the refresh.
+  if (virtual_display != NULL) {
+    virtual_display->PrintStats(stderr);
+    delete virtual_display;
+    if (virtual_fd >= 0)
+      close(virtual_fd);
+  }
 
   return 0;
 }
@@ -15,6 +15,7 @@
 
 #ifndef RPI_CANVAS_H
 #define RPI_CANVAS_H
+#include <stddef.h>
 #include <stdint.h>
 
 namespace rgb_matrix {
@@ -41,6 +42,29 @@ public:
 
   // Fill screen with given 24bpp color.
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) = 0;
+
+  // -- Drawing more than a pixel at a time. All of these are clipped to the
+  // canvas. The defaults go through SetPixel(); implementations that can
+  // do better, like the RGBMatrix, override them, so prefer these to
+  // SetPixel() loops.
+
+  // Fill the rectangle of "width" x "height" pixels with its top left
+  // corner at (x,y) with the given color.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+
+  // Set "count" pixels of row "y", starting at column "x", to the colors
+  // in "rgb": 3 bytes per pixel, red, green, blue.
+  virtual void DrawHSpan(int x, int y, int count, const uint8_t *rgb);
+
+  // Copy an image of "width" x "height" pixels, 3 bytes per pixel (red,
+  // green, blue), with its top left corner to (x,y). "stride" is the
+  // number of bytes from the start of one row to the start of the next.
+  // If "color_key" (3 bytes) is given, pixels of exactly that color are
+  // transparent: the canvas keeps what it has there.
+  virtual void Blit(int x, int y, int width, int height,
+                    const uint8_t *rgb, int stride,
+                    const uint8_t *color_key = NULL);
 };
 
 }  // namespace rgb_matrix
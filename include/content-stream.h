@@ -0,0 +1,205 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Recording what the display shows into a compact stream, and playing such
+// a stream back.
+//
+// Stream format; all numbers little endian.
+//   Header, 16 bytes: "RGBSTRM1", uint16 width, uint16 height, 4 bytes 0.
+//   Then one record per frame:
+//     uint8 type ('K': keyframe, 'D': delta), 3 bytes 0,
+//     uint32 payload bytes, int64 timestamp in microseconds since the first
+//     frame, then the payload.
+//   A keyframe payload has all rows; a delta payload has a bitmap of the
+//   rows that differ from the previous frame (bit y % 8 of byte y / 8),
+//   followed by just those rows. Rows are run length encoded pixels:
+//   a control byte c < 128 is followed by c + 1 literal pixels (3 bytes
+//   each, red, green, blue), c >= 128 by one pixel repeated c - 126 times.
+
+#ifndef RPI_CONTENT_STREAM_H
+#define RPI_CONTENT_STREAM_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+
+#include "thread.h"
+
+namespace rgb_matrix {
+class Canvas;
+class FrameCanvas;
+
+// Compresses frames into a stream written to a file descriptor.
+class StreamWriter {
+public:
+  // Write frames of width x height pixels to "fd", which is not closed.
+  // Every "keyframe_interval"th frame is a keyframe, so that a damaged
+  // stream recovers and a player can start there.
+  StreamWriter(int fd, int width, int height, int keyframe_interval = 100);
+
+  // Append a frame, "rgb" being width x height RGB pixels with "stride"
+  // bytes from one row to the next. Returns false if writing failed.
+  bool AppendFrame(const uint8_t *rgb, int stride, int64_t timestamp_usec);
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+  uint64_t frames() const { return frames_; }
+  uint64_t bytes_written() const { return bytes_written_; }
+
+private:
+  bool Write(const uint8_t *data, int size);
+
+  const int fd_;
+  const int width_;
+  const int height_;
+  const int keyframe_interval_;
+  uint64_t frames_;
+  uint64_t bytes_written_;
+  bool ok_;
+  std::vector<uint8_t> previous_;   // Last frame, to compute the delta.
+  std::vector<uint8_t> record_;     // Scratch space, large enough for any.
+};
+
+// Decodes a stream written by StreamWriter.
+class StreamReader {
+public:
+  // Read from "fd", which is not closed. Check ok() to see if the header
+  // was valid; frames larger than 4194304 pixels are refused.
+  explicit StreamReader(int fd);
+
+  bool ok() const { return width_ > 0; }
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Decode the next frame. Returns false at the end of the stream or if
+  // the record is broken.
+  bool ReadFrame(int64_t *timestamp_usec);
+
+  // The frame decoded last: width() x height() RGB pixels, 3 * width()
+  // bytes per row.
+  const uint8_t *frame() const { return &frame_[0]; }
+  // Whether row "y" changed with the last ReadFrame(); all rows do with a
+  // keyframe.
+  bool row_changed(int y) const { return changed_[y]; }
+
+  // Go back to the first frame. Returns false if "fd" can't seek.
+  bool Rewind();
+
+private:
+  bool DecodeRow(const uint8_t **in, const uint8_t *end, uint8_t *out);
+
+  const int fd_;
+  int width_;
+  int height_;
+  int64_t data_start_;   // File offset of the first frame; -1: can't seek.
+  std::vector<uint8_t> frame_;
+  std::vector<bool> changed_;
+  std::vector<uint8_t> payload_;
+};
+
+// Records the frames of a display into a stream without slowing down
+// whoever hands them over: they are copied into a queue and compressed and
+// written out by a thread of regular priority. If that falls behind, new
+// frames are dropped (and counted) instead of waiting. Typically used with
+// RGBMatrix::SetRecorder().
+class StreamRecorder : private Thread {
+public:
+  // Record width x height frames into "fd", which is not closed. Up to
+  // "queue_frames" frames can wait to be written.
+  StreamRecorder(int fd, int width, int height, int keyframe_interval = 100,
+                 int queue_frames = 8);
+  // Writes out what's queued. Make sure nothing is recording anymore.
+  virtual ~StreamRecorder();
+
+  int width() const { return writer_.width(); }
+  int height() const { return writer_.height(); }
+
+  // Record a frame of width x height RGB pixels with "stride" bytes per
+  // row, timestamped now. Returns false if it was dropped.
+  bool AddFrame(const uint8_t *rgb, int stride);
+
+  // The same without copying through a buffer of your own: fill the
+  // buffer returned by AcquireFrame() (3 * width() bytes per row), then
+  // hand it back with CommitFrame(), which timestamps it. AcquireFrame()
+  // returns NULL if the frame has to be dropped.
+  uint8_t *AcquireFrame();
+  void CommitFrame(uint8_t *buffer);
+
+  // Frames recorded and dropped so far.
+  uint64_t recorded_frames() const;
+  uint64_t dropped_frames() const;
+  // False once writing failed; nothing is recorded after that.
+  bool ok() const;
+
+private:
+  enum SlotState { kFree, kFilling, kReady };
+  struct Slot {
+    SlotState state;
+    int64_t timestamp_usec;
+    uint8_t *rgb;
+  };
+
+  virtual void Run();
+
+  StreamWriter writer_;
+  const int frame_bytes_;
+  std::vector<Slot> slots_;
+  mutable Mutex mutex_;
+  pthread_cond_t ready_;
+  int next_acquire_;      // Slot AcquireFrame() hands out next.
+  int next_write_;        // Slot written out next.
+  int64_t first_timestamp_;
+  uint64_t recorded_;
+  uint64_t dropped_;
+  bool write_failed_;
+  bool stopping_;
+};
+
+// Shows the frames of a stream on a canvas.
+class StreamPlayer {
+public:
+  // Play "reader" from where it is. With "realtime", frames are shown at
+  // the pace they were recorded; otherwise as fast as they can be decoded,
+  // e.g. for benchmarking.
+  StreamPlayer(StreamReader *reader, bool realtime = true);
+
+  // Decode the next frame, wait until it is due and draw it. Returns false
+  // at the end of the stream. Frames are drawn at the top left; whatever
+  // is outside the canvas is clipped.
+  // This only draws the rows that changed, so the canvas needs to keep
+  // its content from frame to frame, like the RGBMatrix does.
+  bool ShowNext(Canvas *canvas);
+  // Same for canvases that are swapped: draws the whole frame, which
+  // FrameCanvas::SetPixels() only encodes where it differs from what the
+  // canvas holds.
+  bool ShowNext(FrameCanvas *canvas);
+
+  // Start over with the first frame; see StreamReader::Rewind().
+  bool Rewind();
+
+  uint64_t frames_shown() const { return frames_shown_; }
+
+private:
+  bool NextFrame();
+
+  StreamReader *const reader_;
+  const bool realtime_;
+  int64_t start_nanos_;        // When the first frame was shown.
+  int64_t first_timestamp_;
+  uint64_t frames_shown_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_CONTENT_STREAM_H
@@ -0,0 +1,144 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#ifndef RPI_GPIO_SIMULATOR_H
+#define RPI_GPIO_SIMULATOR_H
+
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+
+namespace rgb_matrix {
+// Drop-in replacement for GPIO that doesn't need any hardware: all writes
+// are recorded with a timestamp into a ring buffer. Hand it to
+// RGBMatrix::SetSimulator() and the refresh thread writes here instead.
+//
+// The recording can then be replayed through a model of the panels (shift
+// registers, latch, output enable, row address) to see what would have
+// been displayed. Only do that while nothing is writing, e.g. after the
+// RGBMatrix is gone.
+class GPIOSimulator {
+public:
+  enum { kMaxParallel = 3 };
+
+  struct Event {
+    int64_t nanos;     // CLOCK_MONOTONIC
+    uint32_t bits;
+    uint32_t set;      // 1: SetBits(), 0: ClearBits()
+  };
+
+  // The bits the framebuffer uses for each function. Filled in by the
+  // RGBMatrix this simulator is given to.
+  struct Pins {
+    uint32_t clock;
+    uint32_t strobe;
+    uint32_t output_enable;     // Active low.
+    uint32_t row[5];            // Row address, LSB first.
+    int row_bits;
+    // [chain][upper/lower half][red, green, blue]
+    uint32_t color[kMaxParallel][2][3];
+    int parallel;               // Chains connected.
+    bool inverse_colors;        // Color bits are active low.
+  };
+
+  // A period of time the LEDs were switched on.
+  struct LitPhase {
+    int64_t start_nanos;
+    int64_t duration_nanos;
+    int double_row;
+    int plane;      // Counted from the first plane shown in this row.
+    // Latched colors for each column: bits 0..2 upper red, green, blue,
+    // bits 3..5 lower red, green, blue of the first chain; the next six
+    // bits for the next chain and so on.
+    std::vector<uint32_t> colors;
+  };
+
+  // Keeps the last "capacity" writes (rounded up to a power of two).
+  explicit GPIOSimulator(int capacity = 1 << 20);
+
+  // -- Same interface as GPIO as far as the framebuffer is concerned.
+  inline void SetBits(uint32_t value) { Record(value, 1); }
+  inline void ClearBits(uint32_t value) { Record(value, 0); }
+  inline void WriteMaskedBits(uint32_t value, uint32_t mask) {
+    ClearBits(~value & mask);
+    SetBits(value & mask);
+  }
+
+  // -- Geometry of the simulated panels. Set by RGBMatrix::SetSimulator().
+  void Configure(const Pins &pins, int double_rows, int columns);
+  int double_rows() const { return double_rows_; }
+  int columns() const { return columns_; }
+  // Rows of all chains, stacked vertically as in the RGBMatrix.
+  int height() const { return 2 * double_rows_ * pins_.parallel; }
+
+  // -- The recording.
+  // Forget all writes recorded so far.
+  void Reset() { written_ = 0; }
+  // Total number of writes since the last Reset(). Only the last
+  // capacity() of these are kept.
+  uint64_t total_writes() const { return written_; }
+  int capacity() const { return ring_.size(); }
+  int event_count() const;
+  // Recorded event; 0 is the oldest still available.
+  const Event &event(int i) const;
+
+  // -- Panel model.
+  // Replay the recorded writes, appending every period the LEDs were lit
+  // to "phases", oldest first. Returns the number of phases found.
+  int Replay(std::vector<LitPhase> *phases) const;
+
+  // Reconstructs what was shown in the most recent occurrence of "plane"
+  // for each row into "rgb" (height() x columns, 3 bytes per pixel, 0 or
+  // 255 per color). Returns false if some row didn't show that plane
+  // in the recording.
+  bool ReconstructPlane(int plane, uint8_t *rgb) const;
+
+  // Reconstructs the perceived image of the most recent complete refresh
+  // of each row: every color is the fraction of the row's on-time it was
+  // lit, scaled to 0..255. As this is what the LEDs emit, the values are
+  // luminance corrected if the matrix does that.
+  // Returns false if there is no complete refresh of every row.
+  bool ReconstructImage(uint8_t *rgb) const;
+
+private:
+  inline void Record(uint32_t bits, uint32_t set) {
+    Event &e = ring_[written_ & mask_];
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    e.nanos = (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    e.bits = bits;
+    e.set = set;
+    ++written_;
+  }
+
+  // The pin of bit "bit" in LitPhase::colors.
+  uint32_t ColorPin(int bit) const {
+    return pins_.color[bit / 6][bit / 3 % 2][bit % 3];
+  }
+
+  // Collect the complete row refreshes: for each row, the phases of the
+  // last full run through its planes.
+  bool LastRowRefreshes(std::vector<std::vector<LitPhase> > *rows) const;
+
+  std::vector<Event> ring_;
+  uint64_t mask_;
+  uint64_t written_;
+
+  Pins pins_;
+  int double_rows_;
+  int columns_;
+};
+}  // end namespace rgb_matrix
+#endif  // RPI_GPIO_SIMULATOR_H
@@ -19,36 +19,244 @@
 #define RPI_RGBMATRIX_H
 
 #include <stdint.h>
+#include <string>
+#include <vector>
+
 #include "gpio.h"
 #include "canvas.h"
+#include "thread.h"
 
 namespace rgb_matrix {
+class FrameCanvas;
+class GPIOSimulator;
+class StreamRecorder;
+class VirtualDisplay;
+
+// Memory layout of the pixel buffers passed to SetPixels().
+enum PixelFormat {
+  kRGB24,    // 3 bytes per pixel: red, green, blue.
+  kRGBX32    // 4 bytes per pixel: red, green, blue, ignored.
+};
+
+// How 8 bit color values map to the time the LEDs are on, see
+// RGBMatrix::SetResponseCurve(). Computed in floating point and rounded
+// once to the precision that is actually displayed.
+struct ResponseCurve {
+  enum Type {
+    kLinear,     // On-time proportional to the value.
+    kCIE1931,    // Perceived brightness proportional to the value.
+    kGamma,      // On-time proportional to (value / 255) ^ gamma.
+    kTable       // On-time given by "table".
+  };
+
+  explicit ResponseCurve(Type type = kCIE1931);
+
+  Type type;
+  float gamma;              // kGamma: exponent, > 0.
+  uint16_t table[256];      // kTable: 0 (off) .. 65535 (fully on).
+
+  // White point: each channel is scaled by its gain (0..1), e.g. to
+  // balance panels with a blue tint. Applies to every type.
+  float gain[3];            // red, green, blue
+};
+
+// Statistics of the display refresh, see RGBMatrix::GetRefreshStats().
+// Times are in nanoseconds. A refresh period is the time from the start of
+// one full refresh of the panels to the start of the next.
+struct RefreshStats {
+  enum { kMaxPlanes = 11 };
+
+  uint64_t frames;               // Refreshes done.
+  int pwm_bits;                  // Planes shown right now.
+  int dither_phases;             // Refreshes a dither cycle takes; 1: off.
+  int64_t min_period;
+  int64_t avg_period;
+  int64_t max_period;
+  int64_t p50_period;            // Percentiles, 100usec resolution.
+  int64_t p90_period;
+  int64_t p99_period;
+  int64_t deadline;              // As set with set_refresh_deadline_usec().
+  uint64_t missed_deadlines;     // Periods longer than the deadline.
+  double duty_cycle;             // Fraction of the time LEDs were on.
+
+  // How much longer than intended each bitplane was lit, indexed by plane
+  // (0: least significant of the 11). Planes not shown are 0.
+  int64_t avg_plane_overshoot[kMaxPlanes];
+  int64_t max_plane_overshoot[kMaxPlanes];
+};
+
 // The RGB matrix provides the framebuffer and the facilities to constantly
 // update the LED matrix.
 class RGBMatrix : public Canvas {
 public:
   // Initialize RGB matrix with GPIO to write to. The "rows" are the number
-  // of rows supported by the display, so 32 or 16. Number of "chained_display"s
-  // tells many of these are daisy-chained together.
+  // of rows supported by the display, so 16, 32 or 64 (the latter use the
+  // E address line). Number of "chained_display"s tells many of these are
+  // daisy-chained together, counted in units of 32 columns: a 64x64 panel
+  // counts as two.
+  // Up to three such chains can be connected in "parallel": they share
+  // clock, strobe, output enable and row address, but have their own color
+  // pins, so they are refreshed at the same time, as fast as one chain.
+  // They are stacked vertically: the canvas is rows * parallel_displays
+  // high, the first chain on top.
   // If "io" is not NULL, starts refreshing the screen immediately; you can
   // defer that by setting GPIO later with SetGPIO().
-  RGBMatrix(GPIO *io, int rows = 32, int chained_displays = 1);
+  RGBMatrix(GPIO *io, int rows = 32, int chained_displays = 1,
+            int parallel_displays = 1);
   virtual ~RGBMatrix();
 
   // Set GPIO output if it was not set already in constructor (oterwise: no-op).
   // Starts display refresh thread if this is the first setting.
   void SetGPIO(GPIO *io);
 
+  // Instead of real GPIO, refresh into a simulator, e.g. to benchmark or
+  // check the output on a machine without LED panels. Only one of
+  // SetGPIO(), SetSimulator() and SetVirtualDisplay() can be used.
+  void SetSimulator(GPIOSimulator *simulator);
+
+  // Without any hardware, show what the panels would on a terminal or as
+  // images (see virtual-display.h): the refresh thread emulates each
+  // refresh at the display's frame rate instead of writing to GPIO.
+  // Everything else works as with panels; the adaptive PWM depth is off, as
+  // there is no real refresh rate. The display has to outlive the matrix.
+  void SetVirtualDisplay(VirtualDisplay *display);
+
+  // How the refresh thread is run. By default with SCHED_FIFO priority 99,
+  // any CPU, named "rgb-refresh". Pinning it to a CPU that is kept free of
+  // other work (isolcpus=) avoids most flicker. Locking memory keeps the
+  // refresh from stalling on page faults, but applies to the whole process,
+  // so it is only done if asked for.
+  // Only takes effect if set before refreshing starts: construct with
+  // io == NULL, set this, then SetGPIO(). Returns false if too late.
+  // With a simulator or virtual display, the thread is not realtime unless
+  // this was set.
+  bool SetRefreshThreadOptions(const ThreadOptions &options);
+  // What actually took effect; realtime scheduling and memory locking
+  // typically need root. Check status.failed to find out whether
+  // everything asked for is in place.
+  const ThreadStatus &refresh_thread_status() const;
+
+  // Number of display refreshes completed so far: goes up by one every
+  // time the whole frame was shown once.
+  uint64_t refresh_count() const;
+  // Block until "count" more refreshes are completed, to pace updates
+  // with the display instead of sleeping. Returns refresh_count(); returns
+  // right away if the display is not refreshing.
+  uint64_t WaitForRefreshes(int count = 1);
+  // File descriptor that becomes readable whenever refreshes completed,
+  // for select()/poll()/epoll() loops. Reading 8 bytes (an uint64_t)
+  // returns the number of refreshes since the last read. Non-blocking;
+  // owned by the matrix. -1 if it could not be created.
+  int refresh_event_fd();
+
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
+  // Applies to all FrameCanvases of this matrix.
   // Returns boolean to signify if value was within range.
   bool SetPWMBits(uint8_t value);
   uint8_t pwmbits();
 
   // Map brightness of output linearly to input with CIE1931 profile.
+  // Applies to all FrameCanvases of this matrix. Shorthand for a
+  // response curve of type kCIE1931 (on) or kLinear (off).
   void set_luminance_correct(bool on);
   bool luminance_correct() const;
 
+  // How color values map to brightness; CIE1931 by default. Applies to all
+  // FrameCanvases of this matrix, whose content is encoded again; the
+  // display keeps refreshing the previous encoding until that is done.
+  // Returns false if the curve has invalid parameters.
+  bool SetResponseCurve(const ResponseCurve &curve);
+  const ResponseCurve &response_curve() const;
+
+  // Temporal dithering: recover "bits" (0..4, default 0: off) of the color
+  // depth that SetPWMBits() cut off. Each frame is encoded in 2^bits
+  // variants that round slightly differently, and successive refreshes
+  // cycle through them, so the average over a cycle has the extra
+  // precision while refreshing at the speed of the lower PWM depth.
+  // Neighboring pixels are offset in the cycle to avoid flicker of large
+  // areas. Costs 2^bits the memory and encoding time; never more than the
+  // planes cut off are recovered. Applies to all FrameCanvases.
+  // Returns boolean to signify if value was within range.
+  bool SetDitherBits(uint8_t bits);
+  uint8_t ditherbits() const;
+
+  // Global brightness in percent (0..100, default 100). Scales how long
+  // the LEDs are switched on, so it doesn't touch the content and takes
+  // effect with the next refresh: fading the whole display is cheap.
+  // The refresh rate stays the same.
+  // Returns boolean to signify if value was within range.
+  bool SetBrightness(uint8_t brightness);
+  uint8_t brightness() const;
+
+  // Adaptive PWM depth: measure the refresh rate and leave out least
+  // significant planes while it is below "hz", adding them back (with
+  // hysteresis) when there is room again. Never shows more than
+  // SetPWMBits() allows. 0 (default) switches it off.
+  void set_min_refresh_rate(int hz);
+  int min_refresh_rate() const;
+  // The number of planes currently shown; what the adaptive PWM depth
+  // decided, or pwmbits() if that is switched off.
+  int shown_pwm_bits() const;
+
+  // Clock the next bitplane into the panels while the current one is lit,
+  // instead of doing it while dark. Increases refresh rate and brightness,
+  // in particular with long chains, at the same PWM depth. Off by default.
+  void set_pipelined_output(bool on);
+  bool pipelined_output() const;
+
+  // Refresh statistics since the start or the last ResetRefreshStats().
+  // Always collected; cheap enough to be polled by monitoring.
+  void GetRefreshStats(RefreshStats *stats) const;
+  void ResetRefreshStats();
+
+  // Refresh periods longer than this count as missed deadline in the
+  // statistics, e.g. to detect flicker. 0 (default) disables it.
+  void set_refresh_deadline_usec(int usec);
+  int refresh_deadline_usec() const;
+
+  // Create a new off-screen buffer with the same geometry and settings as
+  // the matrix. It can be filled at leisure, then handed to SwapOnVSync() to
+  // be displayed. The returned canvas is owned by the RGBMatrix; don't
+  // delete it.
+  FrameCanvas *CreateFrameCanvas();
+
+  // Create an off-screen buffer that is larger than the display, a scroll
+  // window: virtual_width x virtual_height (at least width() x height(),
+  // at most 65535 each and 4194304 pixels in total). The display shows the
+  // part at its scroll offset, see FrameCanvas::SetScrollOffset(), wrapping
+  // around at the edges.
+  // Scrolling is then only a matter of changing the offset, which the
+  // refresh picks up without any encoding; only newly exposed content
+  // needs to be drawn. Vertical scrolling (a virtual_height larger than
+  // height()) keeps each row encoded once for every half-panel, so costs
+  // that many times the memory and encoding time. Returns NULL if the size
+  // is out of range. Owned by the RGBMatrix like CreateFrameCanvas().
+  FrameCanvas *CreateScrollCanvas(int virtual_width, int virtual_height);
+
+  // Free a canvas created with CreateFrameCanvas() or CreateScrollCanvas()
+  // that is not needed anymore, e.g. a scroll window for content of another
+  // size. Returns false and leaves it alone if it is shown or handed over
+  // to be shown, or was not created by this RGBMatrix.
+  bool DeleteFrameCanvas(FrameCanvas *canvas);
+
+  // Schedule "other" to be displayed at the next frame boundary, so that the
+  // displayed image is never a mix of two frames. Blocks until the swap
+  // happened and returns the previously displayed FrameCanvas, which is
+  // now free to be re-used for drawing the next frame.
+  // Nothing is copied; this is a pointer swap.
+  FrameCanvas *SwapOnVSync(FrameCanvas *other);
+
+  // Non-blocking alternative to SwapOnVSync() (triple buffering): "frame"
+  // is shown from the next refresh on, and this returns right away with a
+  // canvas that is free to draw the next frame into. If frames come faster
+  // than the display refreshes, the newest one is shown and the others
+  // come back here unseen. Neither the caller nor the refresh thread ever
+  // waits for the other, so a low priority producer can't delay the
+  // refresh. The first call creates the third canvas. Call from one
+  // thread only, and don't mix with SwapOnVSync().
+  FrameCanvas *PublishFrame(FrameCanvas *frame);
+
   // -- Canvas interface. These write to the active FrameCanvas
   // (see documentation in canvas.h)
   virtual int width() const;
@@ -57,6 +265,50 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  // These clip once and encode whole spans at a time, see FrameCanvas.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void DrawHSpan(int x, int y, int count, const uint8_t *rgb);
+  virtual void Blit(int x, int y, int width, int height,
+                    const uint8_t *rgb, int stride,
+                    const uint8_t *color_key = NULL);
+
+  // Set a whole rectangle of pixels from a buffer in one go, which is a lot
+  // cheaper than calling SetPixel() for each of them. "data" points to the
+  // pixel that ends up at (x,y); "stride" is the number of bytes from the
+  // start of one row to the start of the next. Clipped to the canvas.
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *data, int stride,
+                 PixelFormat format = kRGB24);
+
+  // Read back the active FrameCanvas, see FrameCanvas::GetPixel() and
+  // FrameCanvas::GetPixels().
+  bool GetPixel(int x, int y,
+                uint8_t *red, uint8_t *green, uint8_t *blue) const;
+  void GetPixels(int x, int y, int width, int height,
+                 uint8_t *data, int stride,
+                 PixelFormat format = kRGB24) const;
+
+  // Copy the frame that is currently displayed into "data", width() x
+  // height() pixels (of a scroll window, the part shown), e.g. for
+  // monitoring. These are the colors as set, before response curve and
+  // brightness. Doesn't hold up the refresh; if the frame is drawn to at
+  // the same time, the copy may show parts of both old and new content.
+  void Screenshot(uint8_t *data, int stride,
+                  PixelFormat format = kRGB24) const;
+
+  // Record what is displayed into "recorder" (see content-stream.h), or
+  // stop recording with NULL. Every frame handed to SwapOnVSync() or
+  // PublishFrame() is copied to the recorder as it is handed over, so the
+  // refresh thread is not involved. Content drawn straight onto the matrix
+  // is recorded with RecordFrame(). The recorder has to be width() x
+  // height(); returns false if it isn't. Only change while no frames are
+  // handed over.
+  bool SetRecorder(StreamRecorder *recorder);
+  // Record the frame that is displayed right now, e.g. whenever a frame
+  // drawn onto the matrix is complete. Returns false if not recording or
+  // the recorder had to drop it.
+  bool RecordFrame();
 
 private:
   class Framebuffer;
@@ -64,12 +316,113 @@ private:
   friend class UpdateThread;
   friend class FrameCanvas;
 
-  // Updates the screen regularly.
-  void UpdateScreen();
+  FrameCanvas *CreateCanvas(int virtual_width, int virtual_height);
+  bool Record(const FrameCanvas *frame);
+  ThreadOptions NonRealtimeOptions() const;
+
+  const int rows_;
+  const int chained_displays_;
+  const int parallel_displays_;
+  uint8_t pwm_bits_;          // Settings for newly created FrameCanvases.
+  ResponseCurve curve_;
+  uint8_t dither_bits_;
+  ThreadOptions thread_options_;
+  std::string thread_name_;
+  bool thread_options_set_;
+
+  FrameCanvas *active_;       // The canvas our Canvas interface writes to.
+  std::vector<FrameCanvas*> created_frames_;
 
-  Framebuffer *frame_;
   GPIO *io_;
+  GPIOSimulator *simulator_;
+  VirtualDisplay *virtual_display_;
   UpdateThread *updater_;
+  StreamRecorder *recorder_;
+};
+
+// A frame buffer that can be filled off-screen and then be swapped in with
+// RGBMatrix::SwapOnVSync(). Create with RGBMatrix::CreateFrameCanvas().
+class FrameCanvas : public Canvas {
+public:
+  // Set PWM bits used for this frame. See RGBMatrix::SetPWMBits().
+  bool SetPWMBits(uint8_t value);
+  uint8_t pwmbits();
+
+  // Map brightness of output linearly to input with CIE1931 profile.
+  void set_luminance_correct(bool on);
+  bool luminance_correct() const;
+
+  // Response curve of this frame. See RGBMatrix::SetResponseCurve().
+  bool SetResponseCurve(const ResponseCurve &curve);
+  const ResponseCurve &response_curve() const;
+
+  // Temporal dithering for this frame. See RGBMatrix::SetDitherBits().
+  bool SetDitherBits(uint8_t bits);
+  uint8_t ditherbits() const;
+
+  // -- Canvas interface.
+  virtual int width() const;
+  virtual int height() const;
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void Clear();
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  // Clipped once for the whole span or rectangle. FillRect() writes the
+  // bitplanes of the color straight along each row; DrawHSpan() and Blit()
+  // encode like SetPixels(), each row once, from its first to its last
+  // changed opaque pixel with a color key, skipping rows that don't change.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void DrawHSpan(int x, int y, int count, const uint8_t *rgb);
+  virtual void Blit(int x, int y, int width, int height,
+                    const uint8_t *rgb, int stride,
+                    const uint8_t *color_key = NULL);
+
+  // Bulk upload. See RGBMatrix::SetPixels().
+  // Rows that are identical to what the canvas already contains are not
+  // encoded again, so re-uploading mostly static content is cheap.
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *data, int stride,
+                 PixelFormat format = kRGB24);
+
+  // Read back what was set. The canvas keeps the colors as set next to
+  // their encoding, so this is exact and needs no buffer of your own for
+  // read-modify-write effects. GetPixel() returns false outside the canvas.
+  bool GetPixel(int x, int y,
+                uint8_t *red, uint8_t *green, uint8_t *blue) const;
+  // Copy out a rectangle; the counterpart of SetPixels(). Only the part
+  // within the canvas is written; with kRGBX32, the fourth byte is left
+  // alone.
+  void GetPixels(int x, int y, int width, int height,
+                 uint8_t *data, int stride,
+                 PixelFormat format = kRGB24) const;
+
+  // Scroll window created with RGBMatrix::CreateScrollCanvas(): the
+  // canvas position shown at the top left of the display. Wraps around;
+  // takes effect with the next refresh, also while this is displayed.
+  // Vertical offsets need a canvas higher than the display.
+  void SetScrollOffset(int x, int y);
+  int scroll_x() const;
+  int scroll_y() const;
+
+  // Number of double rows (row n and n + height/2 are output together)
+  // modified since this canvas was last passed to SwapOnVSync().
+  int modified_double_rows() const;
+
+  // Rows passed to SetPixels() so far that actually had to be encoded,
+  // and rows that were skipped because their content did not change.
+  uint64_t encoded_rows() const;
+  uint64_t skipped_rows() const;
+
+private:
+  friend class RGBMatrix;
+
+  FrameCanvas(RGBMatrix::Framebuffer *frame) : frame_(frame) {}
+  virtual ~FrameCanvas();   // Owned by the RGBMatrix.
+
+  RGBMatrix::Framebuffer *framebuffer() { return frame_; }
+
+  RGBMatrix::Framebuffer *const frame_;
 };
 }  // end namespace rgb_matrix
 #endif  // RPI_RGBMATRIX_H
@@ -17,8 +17,40 @@
 #define RPI_THREAD_H
 
 #include <pthread.h>
+#include <sched.h>
 
 namespace rgb_matrix {
+// How a thread is run. The defaults give a regular thread.
+struct ThreadOptions {
+  ThreadOptions()
+    : policy(SCHED_OTHER), priority(0), cpu(-1), name(NULL),
+      lock_memory(false) {}
+
+  int policy;          // SCHED_OTHER, or SCHED_FIFO/SCHED_RR for realtime.
+  int priority;        // Realtime priority, 1..99.
+  int cpu;             // Only run on this CPU, e.g. one kept free with
+                       // isolcpus=. -1: any.
+  const char *name;    // Shows up in top/ps; at most 15 characters.
+  // Lock all memory of the process, now and in future, so that it is
+  // never paged out and is faulted in up front (mlockall()). From then on,
+  // every allocation and the whole stack of every new thread is resident.
+  bool lock_memory;
+};
+
+// What actually took effect when starting a thread.
+struct ThreadStatus {
+  bool started;
+  int policy;          // As reported for the running thread.
+  int priority;
+  int cpu;             // The one CPU it is pinned to, or -1.
+  char name[16];
+  bool memory_locked;
+  // The first setting that could not be applied and why (an errno value),
+  // or NULL and 0 if everything took effect.
+  const char *failed;
+  int error;
+};
+
 // Simple thread abstraction.
 class Thread {
 public:
@@ -34,13 +66,30 @@ public:
   // thread with SCHED_FIFO and the given priority.
   void Start(int realtime_priority = 0);
 
+  // Start thread with the given options. They are all applied before
+  // Run() is called. Settings that can't be applied (typically for lack of
+  // permissions) are reported on stderr and in status(), but the thread
+  // runs anyway. Returns true if everything took effect.
+  bool Start(const ThreadOptions &options);
+
+  // What Start() achieved.
+  const ThreadStatus &status() const { return status_; }
+
   // Override this.
   virtual void Run() = 0;
 
 private:
   static void *PthreadCallRun(void *tobject);
+  void Failed(const char *what, int error);
+
   bool started_;
   pthread_t thread_;
+  ThreadStatus status_;
+
+  // Run() waits until the thread is set up.
+  pthread_mutex_t start_mutex_;
+  pthread_cond_t start_cond_;
+  bool may_run_;
 };
 
 // Non-recursive Mutex.
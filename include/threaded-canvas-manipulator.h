@@ -62,8 +62,12 @@ public:
   virtual ~ThreadedCanvasManipulator() {  Stop(); }
 
   void Start() {
+    {
+      // Before the thread runs, or Run() might see it stopped right away.
+      MutexLock l(&mutex_);
+      running_ = true;
+    }
     Thread::Start();
-    running_ = true;
   }
 
   // Stop the thread at the next possible time Run() checks the running_ flag.
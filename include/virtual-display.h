@@ -0,0 +1,120 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Showing what the panels would, without any hardware, e.g. to develop
+// content on a workstation.
+
+#ifndef RPI_VIRTUAL_DISPLAY_H
+#define RPI_VIRTUAL_DISPLAY_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "thread.h"
+
+namespace rgb_matrix {
+// Stands in for the panels: hand it to RGBMatrix::SetVirtualDisplay() and
+// the refresh thread, instead of writing to GPIO, works out what the LEDs
+// would emit with the PWM depth, response curve, dithering and brightness
+// in effect, and hands that to ShowFrame() at a steady frame rate.
+//
+// The LEDs emit light proportional to the time they're on, so that's
+// converted to sRGB to look the same on a screen; banding and colors lost
+// to a low PWM depth show just like on the panels.
+class VirtualDisplay {
+public:
+  enum Output {
+    kTerminal,   // 24 bit ANSI colors, two rows per line, redrawn in place.
+    kPPM         // Binary PPM (P6) images, one after the other.
+  };
+
+  // Write to "fd", which is not closed, at "fps" frames per second.
+  VirtualDisplay(int fd, Output output, int fps = 30);
+  // Write one PPM file per frame, named by the printf() "pattern" with the
+  // frame number, e.g. "frame-%05d.ppm". The pattern has to have exactly
+  // one int conversion and no others but "%%", or nothing is written.
+  explicit VirtualDisplay(const char *pattern, int fps = 30);
+  // Leaves the terminal in a usable state.
+  ~VirtualDisplay();
+
+  // Panel size in pixels. Set by RGBMatrix::SetVirtualDisplay().
+  void Configure(int width, int height);
+  int width() const { return width_; }
+  int height() const { return height_; }
+  int fps() const { return fps_; }
+  // False if the pattern is unusable or writing failed.
+  bool ok() const { return ok_; }
+
+  // Called by the refresh thread with each emulated refresh. "lit" has
+  // width() x height() pixels, red, green and blue each the fraction of
+  // the time the LED is on, 0..65535. Waits until the frame is due, then
+  // writes it. Returns false if writing failed; nothing is written after
+  // that.
+  bool ShowFrame(const uint16_t *lit);
+
+  struct Stats {
+    uint64_t frames;          // Shown.
+    uint64_t changed_frames;  // Those that differed from the one before.
+    double seconds;           // Wall time.
+    double display_cpu;       // CPU seconds of the refresh thread.
+    double other_cpu;         // CPU seconds of the rest of the process,
+                              // e.g. whatever draws the content.
+  };
+  // Since the first frame.
+  void GetStats(Stats *stats) const;
+  // Frames per second and CPU time per frame in one line, e.g. to profile
+  // code drawing the content.
+  void PrintStats(FILE *out) const;
+
+private:
+  void Init(int fps);
+  void WaitForFrame();
+  void RenderTerminal(const uint8_t *rgb, bool changed);
+  void RenderPPM(const uint8_t *rgb);
+  bool Write(int fd, const std::string &data);
+  void SnapshotStats(Stats *stats) const;
+  static void Difference(const Stats &later, const Stats &earlier,
+                         Stats *result);
+  static std::string FormatStats(const Stats &stats);
+
+  const int fd_;
+  const Output output_;
+  const std::string pattern_;   // File per frame if not empty.
+  int fps_;
+  int width_;
+  int height_;
+  bool ok_;
+
+  uint8_t srgb_[4096];          // Lit fraction >> 4 to sRGB.
+  std::vector<uint8_t> frame_;
+  std::vector<uint8_t> previous_;
+  std::string out_;
+
+  int64_t next_due_;            // When the next frame is shown.
+  int terminal_lines_;          // Printed with the last frame.
+  Stats window_;                // Start of the stats on the status line.
+  std::string status_;
+
+  // Running totals: times as read from the clocks, frames counted. Only
+  // written by the refresh thread.
+  mutable Mutex mutex_;         // Guards the following.
+  Stats start_;                 // When the first frame came in.
+  Stats current_;
+};
+}  // namespace rgb_matrix
+
+#endif  // RPI_VIRTUAL_DISPLAY_H
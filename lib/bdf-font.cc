@@ -122,10 +122,15 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos, const Color &color,
   y_pos = y_pos - g->height - g->y_offset;
   for (int y = 0; y < g->height; ++y) {
     const rowbitmap_t row = g->bitmap[y];
-    rowbitmap_t x_mask = 0x80000000;
-    for (int x = 0; x < g->width; ++x, x_mask >>= 1) {
-      if (row & x_mask) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
+    // Each run of set pixels in one go.
+    int x = 0;
+    while (x < g->width) {
+      while (x < g->width && !(row & (0x80000000 >> x))) ++x;
+      const int start = x;
+      while (x < g->width && (row & (0x80000000 >> x))) ++x;
+      if (x > start) {
+        c->FillRect(x_pos + start, y_pos + y, x - start, 1,
+                    color.r, color.g, color.b);
       }
     }
   }
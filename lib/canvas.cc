@@ -0,0 +1,58 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Default implementations of the Canvas drawing methods, in terms of
+// SetPixel(). They clip once, so that SetPixel() is only called for pixels
+// on the canvas.
+
+#include "canvas.h"
+#include "clip-internal.h"
+
+namespace rgb_matrix {
+void Canvas::FillRect(int x, int y, int width, int height,
+                      uint8_t red, uint8_t green, uint8_t blue) {
+  int skip_x, skip_y;
+  if (!ClipRect(this->width(), this->height(), &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+  for (int row = y; row < y + height; ++row) {
+    for (int column = x; column < x + width; ++column) {
+      SetPixel(column, row, red, green, blue);
+    }
+  }
+}
+
+void Canvas::DrawHSpan(int x, int y, int count, const uint8_t *rgb) {
+  Blit(x, y, count, 1, rgb, 3 * count);
+}
+
+void Canvas::Blit(int x, int y, int width, int height,
+                  const uint8_t *rgb, int stride, const uint8_t *color_key) {
+  int skip_x, skip_y;
+  if (!ClipRect(this->width(), this->height(), &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+  rgb += skip_y * stride + 3 * skip_x;
+  for (int row = y; row < y + height; ++row, rgb += stride) {
+    const uint8_t *pixel = rgb;
+    for (int column = x; column < x + width; ++column, pixel += 3) {
+      if (color_key != NULL && pixel[0] == color_key[0]
+          && pixel[1] == color_key[1] && pixel[2] == color_key[2])
+        continue;
+      SetPixel(column, row, pixel[0], pixel[1], pixel[2]);
+    }
+  }
+}
+}  // namespace rgb_matrix
@@ -0,0 +1,37 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_RGBMATRIX_CLIP_INTERNAL_H
+#define RPI_RGBMATRIX_CLIP_INTERNAL_H
+
+namespace rgb_matrix {
+// Clip a rectangle to a canvas of "canvas_width" x "canvas_height";
+// "skip_x" and "skip_y" are set to what is cut off at the left and top.
+// Returns false if nothing is left.
+inline bool ClipRect(int canvas_width, int canvas_height,
+                     int *x, int *y, int *width, int *height,
+                     int *skip_x, int *skip_y) {
+  *skip_x = *x < 0 ? -*x : 0;
+  *skip_y = *y < 0 ? -*y : 0;
+  *x += *skip_x;
+  *y += *skip_y;
+  *width -= *skip_x;
+  *height -= *skip_y;
+  if (*x + *width > canvas_width) *width = canvas_width - *x;
+  if (*y + *height > canvas_height) *height = canvas_height - *y;
+  return *width > 0 && *height > 0;
+}
+}  // namespace rgb_matrix
+
+#endif  // RPI_RGBMATRIX_CLIP_INTERNAL_H
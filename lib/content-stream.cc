@@ -0,0 +1,411 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "content-stream.h"
+#include "led-matrix.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace rgb_matrix {
+static const char kMagic[8] = { 'R', 'G', 'B', 'S', 'T', 'R', 'M', '1' };
+enum {
+  kHeaderBytes = 16,
+  kRecordHeaderBytes = 16,
+  kMaxLiteral = 128,   // Pixels in one literal run.
+  kMaxRepeat = 129,    // Pixels in one repeat run.
+  kMaxPixels = 1 << 22 // Largest frame we read: the largest scroll window.
+};
+
+static int64_t GetNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void PutLittleEndian(uint64_t value, int bytes, uint8_t *out) {
+  for (int i = 0; i < bytes; ++i, value >>= 8) out[i] = value & 0xff;
+}
+
+static uint64_t GetLittleEndian(const uint8_t *in, int bytes) {
+  uint64_t value = 0;
+  for (int i = bytes - 1; i >= 0; --i) value = value << 8 | in[i];
+  return value;
+}
+
+static inline bool SamePixel(const uint8_t *a, const uint8_t *b) {
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+static int BitmapBytes(int height) { return (height + 7) / 8; }
+
+// Largest payload a frame can have: every row changed and not compressible.
+static size_t MaxPayloadBytes(int width, int height) {
+  const size_t row =
+    3 * (size_t) width + (width + kMaxLiteral - 1) / kMaxLiteral;
+  return BitmapBytes(height) + height * row;
+}
+
+// Read up to "size" bytes; less only at the end of the file or on error.
+static int ReadFully(int fd, uint8_t *data, int size) {
+  int done = 0;
+  while (done < size) {
+    const ssize_t r = read(fd, data + done, size - done);
+    if (r < 0 && errno == EINTR) continue;
+    if (r <= 0) break;
+    done += r;
+  }
+  return done;
+}
+
+// Run length encode one row of pixels.
+static uint8_t *EncodeRow(const uint8_t *rgb, int width, uint8_t *out) {
+  int x = 0;
+  while (x < width) {
+    int repeat = 1;
+    while (x + repeat < width && repeat < kMaxRepeat
+           && SamePixel(rgb + 3 * x, rgb + 3 * (x + repeat))) {
+      ++repeat;
+    }
+    if (repeat > 1) {
+      *out++ = repeat + 126;
+      memcpy(out, rgb + 3 * x, 3);
+      out += 3;
+      x += repeat;
+      continue;
+    }
+    // Literal pixels up to where the next repeat starts.
+    int count = 1;
+    while (x + count < width && count < kMaxLiteral
+           && !(x + count + 1 < width
+                && SamePixel(rgb + 3 * (x + count),
+                             rgb + 3 * (x + count + 1)))) {
+      ++count;
+    }
+    *out++ = count - 1;
+    memcpy(out, rgb + 3 * x, 3 * count);
+    out += 3 * count;
+    x += count;
+  }
+  return out;
+}
+
+StreamWriter::StreamWriter(int fd, int width, int height,
+                           int keyframe_interval)
+  : fd_(fd), width_(width), height_(height),
+    keyframe_interval_(std::max(1, keyframe_interval)),
+    frames_(0), bytes_written_(0), ok_(true),
+    previous_(3 * (size_t) width * height),
+    record_(kRecordHeaderBytes + MaxPayloadBytes(width, height)) {
+  uint8_t header[kHeaderBytes];
+  memset(header, 0, sizeof(header));
+  memcpy(header, kMagic, sizeof(kMagic));
+  PutLittleEndian(width, 2, header + 8);
+  PutLittleEndian(height, 2, header + 10);
+  Write(header, sizeof(header));
+}
+
+bool StreamWriter::Write(const uint8_t *data, int size) {
+  if (!ok_) return false;
+  while (size > 0) {
+    const ssize_t w = write(fd_, data, size);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) {
+      ok_ = false;
+      return false;
+    }
+    data += w;
+    size -= w;
+    bytes_written_ += w;
+  }
+  return true;
+}
+
+bool StreamWriter::AppendFrame(const uint8_t *rgb, int stride,
+                               int64_t timestamp_usec) {
+  if (!ok_) return false;
+  const int row_bytes = 3 * width_;
+  const bool keyframe = (frames_ % keyframe_interval_) == 0;
+  uint8_t *const record = &record_[0];
+  uint8_t *out = record + kRecordHeaderBytes;
+  uint8_t *bitmap = NULL;
+  if (!keyframe) {
+    bitmap = out;
+    memset(bitmap, 0, BitmapBytes(height_));
+    out += BitmapBytes(height_);
+  }
+  for (int y = 0; y < height_; ++y, rgb += stride) {
+    uint8_t *previous = &previous_[y * row_bytes];
+    if (!keyframe) {
+      if (memcmp(previous, rgb, row_bytes) == 0)
+        continue;
+      bitmap[y / 8] |= 1 << (y % 8);
+    }
+    memcpy(previous, rgb, row_bytes);
+    out = EncodeRow(rgb, width_, out);
+  }
+
+  memset(record, 0, kRecordHeaderBytes);
+  record[0] = keyframe ? 'K' : 'D';
+  PutLittleEndian(out - record - kRecordHeaderBytes, 4, record + 4);
+  PutLittleEndian(timestamp_usec, 8, record + 8);
+  ++frames_;
+  return Write(record, out - record);
+}
+
+StreamReader::StreamReader(int fd)
+  : fd_(fd), width_(0), height_(0), data_start_(-1) {
+  uint8_t header[kHeaderBytes];
+  if (ReadFully(fd, header, sizeof(header)) != sizeof(header)
+      || memcmp(header, kMagic, sizeof(kMagic)) != 0) {
+    return;
+  }
+  const int width = GetLittleEndian(header + 8, 2);
+  const int height = GetLittleEndian(header + 10, 2);
+  if (width == 0 || height == 0 || (int64_t) width * height > kMaxPixels)
+    return;
+  width_ = width;
+  height_ = height;
+  frame_.resize(3 * (size_t) width * height);
+  changed_.resize(height);
+  payload_.resize(MaxPayloadBytes(width, height));
+  data_start_ = lseek(fd, 0, SEEK_CUR);
+}
+
+bool StreamReader::DecodeRow(const uint8_t **in, const uint8_t *end,
+                             uint8_t *out) {
+  const uint8_t *pos = *in;
+  for (int x = 0; x < width_; /**/) {
+    if (pos >= end) return false;
+    const int control = *pos++;
+    if (control < 128) {
+      const int count = control + 1;
+      if (x + count > width_ || pos + 3 * count > end) return false;
+      memcpy(out + 3 * x, pos, 3 * count);
+      pos += 3 * count;
+      x += count;
+    } else {
+      const int count = control - 126;
+      if (x + count > width_ || pos + 3 > end) return false;
+      for (int i = 0; i < count; ++i, ++x) memcpy(out + 3 * x, pos, 3);
+      pos += 3;
+    }
+  }
+  *in = pos;
+  return true;
+}
+
+bool StreamReader::ReadFrame(int64_t *timestamp_usec) {
+  if (!ok()) return false;
+  uint8_t header[kRecordHeaderBytes];
+  if (ReadFully(fd_, header, sizeof(header)) != sizeof(header))
+    return false;
+  const bool keyframe = (header[0] == 'K');
+  if (!keyframe && header[0] != 'D')
+    return false;
+  const uint64_t size = GetLittleEndian(header + 4, 4);
+  if (size > payload_.size()
+      || ReadFully(fd_, &payload_[0], size) != (int) size) {
+    return false;
+  }
+
+  const uint8_t *in = &payload_[0];
+  const uint8_t *const end = in + size;
+  const uint8_t *bitmap = NULL;
+  if (!keyframe) {
+    if (size < (uint64_t) BitmapBytes(height_)) return false;
+    bitmap = in;
+    in += BitmapBytes(height_);
+  }
+  for (int y = 0; y < height_; ++y) {
+    changed_[y] = keyframe || (bitmap[y / 8] & (1 << (y % 8)));
+    if (changed_[y] && !DecodeRow(&in, end, &frame_[3 * width_ * y]))
+      return false;
+  }
+  *timestamp_usec = GetLittleEndian(header + 8, 8);
+  return true;
+}
+
+bool StreamReader::Rewind() {
+  if (data_start_ < 0 || lseek(fd_, data_start_, SEEK_SET) < 0)
+    return false;
+  std::fill(frame_.begin(), frame_.end(), 0);
+  return true;
+}
+
+StreamRecorder::StreamRecorder(int fd, int width, int height,
+                               int keyframe_interval, int queue_frames)
+  : writer_(fd, width, height, keyframe_interval),
+    frame_bytes_(3 * width * height), slots_(std::max(1, queue_frames)),
+    next_acquire_(0), next_write_(0), first_timestamp_(-1),
+    recorded_(0), dropped_(0), write_failed_(false), stopping_(false) {
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    slots_[i].state = kFree;
+    slots_[i].timestamp_usec = 0;
+    slots_[i].rgb = new uint8_t[frame_bytes_];
+  }
+  pthread_cond_init(&ready_, NULL);
+  ThreadOptions options;
+  options.name = "rgb-recorder";
+  Start(options);
+}
+
+StreamRecorder::~StreamRecorder() {
+  {
+    MutexLock l(&mutex_);
+    stopping_ = true;
+    pthread_cond_signal(&ready_);
+  }
+  WaitStopped();
+  pthread_cond_destroy(&ready_);
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    delete [] slots_[i].rgb;
+  }
+}
+
+uint8_t *StreamRecorder::AcquireFrame() {
+  MutexLock l(&mutex_);
+  Slot &slot = slots_[next_acquire_];
+  if (write_failed_ || slot.state != kFree) {
+    ++dropped_;
+    return NULL;
+  }
+  slot.state = kFilling;
+  next_acquire_ = (next_acquire_ + 1) % slots_.size();
+  return slot.rgb;
+}
+
+void StreamRecorder::CommitFrame(uint8_t *buffer) {
+  const int64_t now = GetNanos() / 1000;
+  MutexLock l(&mutex_);
+  for (size_t i = 0; i < slots_.size(); ++i) {
+    if (slots_[i].rgb != buffer) continue;
+    if (first_timestamp_ < 0) first_timestamp_ = now;
+    slots_[i].timestamp_usec = now - first_timestamp_;
+    slots_[i].state = kReady;
+    pthread_cond_signal(&ready_);
+    return;
+  }
+}
+
+bool StreamRecorder::AddFrame(const uint8_t *rgb, int stride) {
+  uint8_t *buffer = AcquireFrame();
+  if (buffer == NULL)
+    return false;
+  const int row_bytes = 3 * width();
+  for (int y = 0; y < height(); ++y, rgb += stride) {
+    memcpy(buffer + y * row_bytes, rgb, row_bytes);
+  }
+  CommitFrame(buffer);
+  return true;
+}
+
+void StreamRecorder::Run() {
+  for (;;) {
+    Slot *slot;
+    {
+      MutexLock l(&mutex_);
+      while (slots_[next_write_].state != kReady && !stopping_) {
+        mutex_.WaitOn(&ready_);
+      }
+      slot = &slots_[next_write_];
+      if (slot->state != kReady)
+        return;   // Stopping and everything is written.
+    }
+    // Compress and write without holding the lock, so that frames can be
+    // queued meanwhile.
+    const bool ok = writer_.AppendFrame(slot->rgb, 3 * width(),
+                                        slot->timestamp_usec);
+    MutexLock l(&mutex_);
+    slot->state = kFree;
+    next_write_ = (next_write_ + 1) % slots_.size();
+    if (ok)
+      ++recorded_;
+    else
+      write_failed_ = true;
+  }
+}
+
+uint64_t StreamRecorder::recorded_frames() const {
+  MutexLock l(&mutex_);
+  return recorded_;
+}
+
+uint64_t StreamRecorder::dropped_frames() const {
+  MutexLock l(&mutex_);
+  return dropped_;
+}
+
+bool StreamRecorder::ok() const {
+  MutexLock l(&mutex_);
+  return !write_failed_;
+}
+
+StreamPlayer::StreamPlayer(StreamReader *reader, bool realtime)
+  : reader_(reader), realtime_(realtime), start_nanos_(-1),
+    first_timestamp_(0), frames_shown_(0) {}
+
+bool StreamPlayer::NextFrame() {
+  int64_t timestamp;
+  if (!reader_->ReadFrame(&timestamp))
+    return false;
+  if (!realtime_)
+    return true;
+  const int64_t now = GetNanos();
+  if (start_nanos_ < 0) {
+    start_nanos_ = now;
+    first_timestamp_ = timestamp;
+    return true;
+  }
+  const int64_t wait = start_nanos_ + 1000 * (timestamp - first_timestamp_)
+    - now;
+  if (wait > 0) {
+    struct timespec sleep_time = { (time_t) (wait / 1000000000),
+                                   (long) (wait % 1000000000) };
+    nanosleep(&sleep_time, NULL);
+  }
+  return true;
+}
+
+bool StreamPlayer::ShowNext(Canvas *canvas) {
+  if (!NextFrame())
+    return false;
+  const int height = std::min(reader_->height(), canvas->height());
+  for (int y = 0; y < height; ++y) {
+    if (!reader_->row_changed(y)) continue;
+    canvas->DrawHSpan(0, y, reader_->width(),
+                      reader_->frame() + 3 * reader_->width() * y);
+  }
+  ++frames_shown_;
+  return true;
+}
+
+bool StreamPlayer::ShowNext(FrameCanvas *canvas) {
+  if (!NextFrame())
+    return false;
+  canvas->SetPixels(0, 0, reader_->width(), reader_->height(),
+                    reader_->frame(), 3 * reader_->width());
+  ++frames_shown_;
+  return true;
+}
+
+bool StreamPlayer::Rewind() {
+  start_nanos_ = -1;
+  return reader_->Rewind();
+}
+}  // namespace rgb_matrix
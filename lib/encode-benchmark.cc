@@ -0,0 +1,145 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Measures how fast frames can be encoded into bitplanes. Doesn't need
+// GPIO access, so it can run on any Linux box.
+//
+//   make -C lib encode-benchmark && lib/encode-benchmark [<chain> [<frames>]]
+
+#include "led-matrix.h"
+#include "plane-encoder-internal.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+using namespace rgb_matrix;
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  const int rows = 32;
+  const int chain = argc > 1 ? atoi(argv[1]) : 8;
+  const int frames = argc > 2 ? atoi(argv[2]) : 500;
+  const int width = 32 * chain;
+  if (chain < 1 || frames < 1) {
+    fprintf(stderr, "usage: %s [<chain> [<frames>]]\n", argv[0]);
+    return 1;
+  }
+
+  // Random content: this is about throughput, not about nice pictures.
+  uint8_t *image = new uint8_t[width * rows * 3];
+  for (int i = 0; i < width * rows * 3; ++i) image[i] = random();
+  // Same, but every row differs, so nothing can be skipped when
+  // alternating between the two.
+  uint8_t *other_image = new uint8_t[width * rows * 3];
+  for (int i = 0; i < width * rows * 3; ++i) other_image[i] = ~image[i];
+
+  const int pixels = width * rows;
+  printf("%dx%d pixels, 11 bitplanes, %d frames\n", width, rows, frames);
+
+  // The raw transpose kernels. A frame has rows/2 double rows, each
+  // with an upper and lower half; 11 planes each.
+  uint16_t *red = new uint16_t[pixels];
+  uint16_t *green = new uint16_t[pixels];
+  uint16_t *blue = new uint16_t[pixels];
+  for (int i = 0; i < pixels; ++i) {
+    red[i] = image[3*i] << 3;
+    green[i] = image[3*i + 1] << 3;
+    blue[i] = image[3*i + 2] << 3;
+  }
+  uint8_t *planes = new uint8_t[width * rows / 2 * 11];
+  const PlaneBitMasks masks[2] = { { 1 << 0, 1 << 1, 1 << 2 },
+                                   { 1 << 3, 1 << 4, 1 << 5 } };
+  for (const PlaneEncoder *e = AvailablePlaneEncoders(); e->name; ++e) {
+    const bool exact = VerifyPlaneEncoder(*e);
+    const double start = Now();
+    for (int f = 0; f < frames; ++f) {
+      for (int y = 0; y < rows; ++y) {
+        e->encode(red + y * width, green + y * width, blue + y * width,
+                  width, masks[y / (rows / 2)], 0, 11,
+                  planes + (y % (rows / 2)) * width * 11, width);
+      }
+    }
+    const double duration = Now() - start;
+    printf("%-8s kernel : %8.1f usec/frame %8.1f MPixel/s %s\n",
+           e->name, 1e6 * duration / frames, pixels * frames / duration / 1e6,
+           exact ? "(bit-exact)" : "(MISMATCH)");
+  }
+
+  // End-to-end through the public API, including color mapping.
+  RGBMatrix matrix(NULL, rows, chain);
+  FrameCanvas *canvas = matrix.CreateFrameCanvas();
+  double start = Now();
+  for (int f = 0; f < frames; ++f) {
+    const uint8_t *const frame = (f & 1) ? other_image : image;
+    for (int y = 0; y < rows; ++y) {
+      for (int x = 0; x < width; ++x) {
+        const uint8_t *p = frame + 3 * (y * width + x);
+        canvas->SetPixel(x, y, p[0], p[1], p[2]);
+      }
+    }
+  }
+  double duration = Now() - start;
+  printf("SetPixel()       : %8.1f usec/frame %8.1f MPixel/s\n",
+         1e6 * duration / frames, pixels * frames / duration / 1e6);
+
+  start = Now();
+  for (int f = 0; f < frames; ++f) {
+    canvas->SetPixels(0, 0, width, rows, (f & 1) ? other_image : image,
+                      width * 3);
+  }
+  duration = Now() - start;
+  printf("SetPixels(%-6s) : %8.1f usec/frame %8.1f MPixel/s\n",
+         GetPlaneEncoder().name,
+         1e6 * duration / frames, pixels * frames / duration / 1e6);
+
+  // Static content with one changing row, like a ticker or clock.
+  const uint64_t encoded_before = canvas->encoded_rows();
+  start = Now();
+  for (int f = 0; f < frames; ++f) {
+    memcpy(image, (f & 1) ? other_image : image + width * 3, width * 3);
+    canvas->SetPixels(0, 0, width, rows, image, width * 3);
+  }
+  duration = Now() - start;
+  printf("SetPixels(static): %8.1f usec/frame %8.1f MPixel/s "
+         "(%.1f rows encoded/frame)\n",
+         1e6 * duration / frames, pixels * frames / duration / 1e6,
+         1.0 * (canvas->encoded_rows() - encoded_before) / frames);
+
+  // Clear() and Fill() write all planes.
+  start = Now();
+  for (int f = 0; f < frames; ++f) canvas->Clear();
+  duration = Now() - start;
+  printf("Clear()          : %8.1f usec/frame\n", 1e6 * duration / frames);
+
+  start = Now();
+  for (int f = 0; f < frames; ++f) canvas->Fill(f, 2 * f, 3 * f);
+  duration = Now() - start;
+  printf("Fill()           : %8.1f usec/frame\n", 1e6 * duration / frames);
+
+  delete [] planes;
+  delete [] red;
+  delete [] green;
+  delete [] blue;
+  delete [] other_image;
+  delete [] image;
+  return 0;
+}
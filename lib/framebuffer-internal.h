@@ -16,6 +16,10 @@
 #define RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
 
 #include "led-matrix.h"
+#include "gpio-simulator.h"
+#include "plane-encoder-internal.h"
+
+#include <string.h>
 
 namespace rgb_matrix {
 // Internal representation of the frame-buffer that as well can
@@ -24,66 +28,261 @@ namespace rgb_matrix {
 // written out.
 class RGBMatrix::Framebuffer {
 public:
-  Framebuffer(int rows, int columns);
+  enum { kMaxParallel = 3 };   // Chains we can drive at the same time.
+  // Largest virtual width x height of a scroll window. Scrolling vertically
+  // with three chains and the deepest dithering, the planes take 336 bytes
+  // per pixel; this keeps them below 2GB.
+  enum { kMaxVirtualPixels = 1 << 22 };
+
+  // "rows" and "columns" of one chain, "parallel" chains of these are
+  // stacked vertically.
+  // With a larger "virtual_columns" and/or "virtual_height", this is a
+  // scroll window: the content is that large and the panels show the part
+  // at the scroll offset, wrapping around at the edges.
+  // Starts out with the given PWM depth, response curve and dither bits,
+  // which are expected to be valid; so the planes are only allocated once.
+  Framebuffer(int rows, int columns, int parallel,
+              int virtual_columns, int virtual_height,
+              int pwm_bits, const ResponseCurve &curve, int dither_bits);
   ~Framebuffer();
 
   // Initialize GPIO bits for output.
-  static void InitGPIO(GPIO *io);
+  static void InitGPIO(GPIO *io, int rows, int parallel);
+
+  // Tell the simulator which bits we use for what.
+  static void DescribePins(GPIOSimulator::Pins *pins, int rows, int parallel);
 
   // Set PWM bits used for output. Default is 11, but if you only deal with
   // simple comic-colors, 1 might be sufficient. Lower require less CPU.
+  // Only the planes of the given depth are stored; changing it re-encodes
+  // the content from the RGB source.
   // Returns boolean to signify if value was within range.
   bool SetPWMBits(uint8_t value);
-  uint8_t pwmbits() { return pwm_bits_; }
+  uint8_t pwmbits() const { return planes_->pwm_bits; }
 
   // Map brightness of output linearly to input with CIE1931 profile.
-  void set_luminance_correct(bool on) { do_luminance_correct_ = on; }
-  bool luminance_correct() const { return do_luminance_correct_; }
+  // Changing it re-encodes the content from the RGB source.
+  void set_luminance_correct(bool on);
+  bool luminance_correct() const {
+    return curve_.type == ResponseCurve::kCIE1931;
+  }
+
+  // Any response curve; re-encodes the content from the RGB source unless
+  // the curve is the same as before.
+  // Returns false if the curve has invalid parameters.
+  bool SetResponseCurve(const ResponseCurve &curve);
+  const ResponseCurve &response_curve() const { return curve_; }
+
+  // Temporal dithering: keep 2^bits encodings of the frame, each rounding
+  // the planes cut off by the PWM depth differently. DumpToMatrix() picks
+  // one per refresh. Changing it re-encodes the content from the RGB source.
+  // Returns boolean to signify if value was within range.
+  bool SetDitherBits(uint8_t bits);
+  uint8_t ditherbits() const { return dither_bits_; }
+  // Encodings actually kept; less than asked for if the PWM depth doesn't
+  // leave enough planes to recover.
+  int dither_phases() const { return planes_->phases; }
+
+  // How long each plane was actually lit, collected by DumpToMatrix().
+  struct PlaneTiming {
+    PlaneTiming() { memset(this, 0, sizeof(*this)); }
+    void Record(int plane, int64_t lit, int64_t target) {
+      const int64_t overshoot = lit - target;
+      overshoot_sum[plane] += overshoot;
+      if (overshoot > overshoot_max[plane]) overshoot_max[plane] = overshoot;
+      count[plane]++;
+      lit_nanos += lit;
+    }
+    // Indexed by plane; overshoot is measured lit time minus target.
+    int64_t overshoot_sum[RefreshStats::kMaxPlanes];
+    int64_t overshoot_max[RefreshStats::kMaxPlanes];
+    uint32_t count[RefreshStats::kMaxPlanes];
+    int64_t lit_nanos;
+  };
+
+  // How DumpToMatrix() outputs the frame.
+  struct OutputOptions {
+    OutputOptions()
+      : pipelined(false), pwm_bits(RefreshStats::kMaxPlanes), brightness(100),
+        refresh(0) {}
+    // Clock in the next bitplane while the current one is lit, see
+    // DumpPipelined().
+    bool pipelined;
+    // Show at most this many of the most significant planes.
+    int pwm_bits;
+    // Percent of the regular on-time the planes are lit.
+    int brightness;
+    // Counts refreshes; selects the dither phase shown.
+    uint32_t refresh;
+  };
+
+  // Output the frame once.
+  // If "timing" is given, the lit time of the planes is added to it.
+  // "Output" is GPIO or GPIOSimulator; a template parameter so that the
+  // inner loop doesn't pay for the choice.
+  template <class Output>
+  void DumpToMatrix(Output *io, const OutputOptions &options = OutputOptions(),
+                    PlaneTiming *timing = NULL);
+
+  // Emulate a refresh with "options" without any output: what the panels
+  // would emit, computed from the planes as DumpToMatrix() would show
+  // them. Writes the panel size, columns x rows of all chains, 3 values per
+  // pixel (red, green, blue) into "lit": the fraction of the refresh the
+  // LED is on, 0..65535, brightness included.
+  void EmulateRefresh(uint16_t *lit,
+                      const OutputOptions &options = OutputOptions());
+  int panel_width() const { return columns_; }
+  int panel_height() const { return height_; }
 
-  void DumpToMatrix(GPIO *io);
+  // Scroll window: the content shown at the top left of the panels.
+  // Normalized to the virtual size; picked up with the next refresh, no
+  // encoding involved. Vertical offsets need a virtual height larger than
+  // the panels.
+  void SetScrollOffset(int x, int y);
+  int scroll_x() const { return ScrollOffset() & 0xffff; }
+  int scroll_y() const { return ScrollOffset() >> 16; }
+
+  // Copy the part shown at the current scroll offset, panel size, into
+  // "data".
+  void GetShownPixels(uint8_t *data, int stride, int bytes_per_pixel) const;
 
   // Canvas-inspired methods, but we're not implementing this interface to not
-  // have an unnecessary vtable.
-  inline int width() const { return columns_; }
-  inline int height() const { return rows_; }
+  // have an unnecessary vtable. In a scroll window, the whole virtual size.
+  inline int width() const { return vcolumns_; }
+  inline int height() const { return vheight_; }
   void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue);
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Encode a whole rectangle of pixels. "data" points to the first pixel of
+  // the first row, "stride" is the byte distance between rows and
+  // "bytes_per_pixel" is 3 (RGB) or 4 (RGBX). Clips to the visible area.
+  void SetPixels(int x, int y, int width, int height,
+                 const uint8_t *data, int stride, int bytes_per_pixel);
+  // Same for a rectangle of one color.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+  // SetPixels() of 24bpp RGB, leaving out the pixels of "color_key" color
+  // (if not NULL).
+  void Blit(int x, int y, int width, int height,
+            const uint8_t *data, int stride, const uint8_t *color_key);
+
+  // Read back what was set, exactly, from the RGB source. GetPixel()
+  // returns false outside the canvas. GetPixels() is the counterpart of
+  // SetPixels(); only the part within the canvas is written, and the
+  // fourth byte of 4 byte pixels is left alone.
+  bool GetPixel(int x, int y,
+                uint8_t *red, uint8_t *green, uint8_t *blue) const;
+  void GetPixels(int x, int y, int width, int height,
+                 uint8_t *data, int stride, int bytes_per_pixel) const;
+
+  // Double rows that have been modified since the last MarkClean().
+  bool IsDirty(int double_row) const { return dirty_[double_row]; }
+  int DirtyDoubleRows() const;
+  void MarkClean();
+
+  // Rows handed to SetPixels() that actually had to be encoded, and those
+  // that were skipped as they were identical to the current content.
+  uint64_t encoded_rows() const { return encoded_rows_; }
+  uint64_t skipped_rows() const { return skipped_rows_; }
+
 private:
-  // Map color
-  inline uint16_t MapColor(uint8_t c);
+  // Everything needed to encode a color channel value for one response
+  // curve and PWM depth, precomputed for all 256 values. The values are
+  // rounded to "precision" bits: the PWM depth plus what dithering adds.
+  struct EncodeTable {
+    EncodeTable(const ResponseCurve &curve, int pwm_bits, int precision);
+    ~EncodeTable();
+
+    // Per channel, the color value mapped to the output range, as used by
+    // the bulk encoder.
+    uint16_t mapped[3][256];
 
-  const int rows_;     // Number of rows. 16 or 32.
+    // Per half (upper, lower) and channel (red, green, blue) the bits to
+    // OR into the entry of each shown plane. For value v, the pwm-bits
+    // entries start at plane_bits[half][channel] + v * pwm_bits.
+    uint8_t *plane_bits[2][3];
+  };
+
+  // Each chain has an upper and lower half sub-panel, each with its own
+  // color bits. Sub-panel 2 * chain + half has row "y".
+  inline int SubPanel(int y) const {
+    return 2 * (y / rows_) + ((y % rows_) < double_rows_ ? 0 : 1);
+  }
+  // The stored double rows and their sub-panels that show row "y".
+  // Returns how many; that is 1 unless scrolling vertically.
+  inline int RowTargets(int y, int *stored_row, int *sub_panel) const;
+  // The output bit of "channel" (red, green, blue) of "sub_panel".
+  static uint32_t ColorBit(int sub_panel, int channel);
+  // The bit of "channel" of the upper (0) or lower (1) half in a plane
+  // entry.
+  static inline uint8_t EntryBit(int half, int channel) {
+    return 1 << (3 * half + channel);
+  }
+  // The address lines set to select "double_row".
+  static uint32_t RowAddress(int double_row);
+  // All address lines needed for panels with this many double rows. A-D
+  // are always driven; E only for 64 row panels (1:32 multiplexing).
+  static uint32_t RowAddressMask(int double_rows);
+
+  const int rows_;     // Number of rows of one chain. 16, 32 or 64.
   const int columns_;  // Number of columns. Number of chained boards * 32.
+  const int parallel_; // Number of chains driven in parallel.
+  const int height_;   // rows_ * parallel_
 
-  uint8_t pwm_bits_;   // PWM bits to display.
-  bool do_luminance_correct_;
+  ResponseCurve curve_;
+  uint8_t dither_bits_;
 
   const int double_rows_;
   const uint8_t row_mask_;
 
+  // Scroll window. Without vertical scrolling, the stored double rows are
+  // the ones shown. With it, each virtual row "v" has a stored double row
+  // holding the rows v, v + double_rows_, v + 2 * double_rows_ ... for
+  // the sub-panels; output starts at the one at the vertical offset. So
+  // every row is encoded once per sub-panel.
+  const int vcolumns_;     // Virtual width; columns_ if not scrolling.
+  const int vheight_;      // Virtual height; height_ if not scrolling.
+  const bool scroll_rows_; // Vertical scrolling possible.
+  const int stored_rows_;  // Double rows in the planes.
+  uint32_t scroll_offset_; // y << 16 | x
+  inline uint32_t ScrollOffset() const {
+    return __atomic_load_n(&scroll_offset_, __ATOMIC_RELAXED);
+  }
+
+  // Up to three chains can be driven in parallel: they share clock, strobe,
+  // output enable and row address, but each has its own color bits
+  // (r1..b2, p1_r1..p1_b2, p2_r1..p2_b2).
   union IoBits {
 #ifdef ADAFRUIT_RGBMATRIX_HAT
     struct {
       // These reflect the GPIO mapping. The Revision1 and Revision2 boards
       // have different GPIO mappings for 0/1 vs 3/4. Just use both.
-      unsigned int unused1 : 4;             // 0-3
+      unsigned int unused1 : 2;             // 0-1
+      unsigned int p2_r2 : 1;               // 2
+      unsigned int p2_g2 : 1;               // 3
       unsigned int output_enable : 1;       // 4
       unsigned int r1 : 1;                  // 5
       unsigned int b1 : 1;                  // 6
-      unsigned int unused2 : 5;             // 7-11
+      unsigned int p1_g2 : 1;               // 7
+      unsigned int p1_b2 : 1;               // 8
+      unsigned int p2_r1 : 1;               // 9
+      unsigned int p2_g1 : 1;               // 10
+      unsigned int p2_b1 : 1;               // 11
       unsigned int r2 : 1;                  // 12
       unsigned int g1 : 1;                  // 13
-      unsigned int unused3 : 2;             // 14-15
+      unsigned int p2_b2 : 1;               // 14
+      unsigned int p1_r1 : 1;               // 15
       unsigned int g2 : 1;                  // 16
       unsigned int clock : 1;               // 17
-      unsigned int unused4 : 2;             // 18-19
+      unsigned int p1_b1 : 1;               // 18
+      unsigned int p1_r2 : 1;               // 19
       unsigned int d : 1;                   // 20
       unsigned int strobe : 1;              // 21
       unsigned int a : 1;                   // 22
       unsigned int b2 : 1;                  // 23
-      unsigned int unused5 : 2;             // 24-25
+      unsigned int e : 1;                   // 24
+      unsigned int p1_g1 : 1;               // 25
       unsigned int b : 1;                   // 26
       unsigned int c : 1;                   // 27
     } bits;
@@ -96,16 +295,25 @@ private:
       unsigned int output_enable_rev2 : 1;  // 2
       unsigned int clock_rev2  : 1;         // 3
       unsigned int strobe : 1;              // 4
-      unsigned int unused2 : 2;             // 5..6
-      unsigned int row : 4;                 // 7..10
-      unsigned int unused3 : 6;             // 11..16
+      unsigned int p2_g2 : 1;               // 5
+      unsigned int p2_b2 : 1;               // 6
+      unsigned int row : 5;                 // 7..11
+      unsigned int p1_r1 : 1;               // 12
+      unsigned int p1_g1 : 1;               // 13
+      unsigned int p1_b1 : 1;               // 14
+      unsigned int p1_r2 : 1;               // 15
+      unsigned int p1_g2 : 1;               // 16
       unsigned int r1 : 1;                  // 17
       unsigned int g1 : 1;                  // 18
-      unsigned int unused4 : 3;
+      unsigned int p1_b2 : 1;               // 19
+      unsigned int p2_r1 : 1;               // 20
+      unsigned int p2_g1 : 1;               // 21
       unsigned int b1 : 1;                  // 22
       unsigned int r2 : 1;                  // 23
       unsigned int g2 : 1;                  // 24
       unsigned int b2 : 1;                  // 25
+      unsigned int p2_b1 : 1;               // 26
+      unsigned int p2_r2 : 1;               // 27
     } bits;
 #endif
     uint32_t raw;
@@ -114,12 +322,111 @@ private:
 
   // The frame-buffer is organized in bitplanes.
   // Highest level (slowest to cycle through) are double rows.
-  // For each double-row, we store pwm-bits columns of a bitplane.
-  // Each bitplane-column is pre-filled IoBits, of which the colors are set.
-  // Of course, that means that we store unrelated bits in the frame-buffer,
-  // but it allows easy access in the critical section.
-  IoBits *bitplane_buffer_;
-  inline IoBits *ValueAt(int double_row, int column, int bit);
+  // For each double-row, we store pwm-bits bitplanes; within each, a run of
+  // columns per chain. An entry is a byte with just the six color bits of
+  // that chain's column (see EntryBit()), so a plane row of a 16 panel
+  // chain is 512 bytes and fits the cache easily. DumpToMatrix() expands
+  // the entries of all chains into the GPIO word through a small table
+  // while clocking in, which costs next to nothing compared to the GPIO
+  // writes.
+  // Only the pwm-bits planes that are actually shown are allocated, so they
+  // are adjacent in memory. Depth, response curve and storage only change
+  // together, hence they are kept in one object that is replaced as a
+  // whole; whoever got hold of it sees a consistent set without locking.
+  //
+  // With temporal dithering, there is a full set of planes for each dither
+  // phase, one after the other. They are addressed as if they were more
+  // double rows: phase * stored_rows + double_row.
+  struct PlaneStorage {
+    PlaneStorage(int depth, int dither_phases, int double_rows, int parallel,
+                 int columns, const EncodeTable *encode_table)
+      : pwm_bits(depth), phases(dither_phases), table(encode_table),
+        size((size_t) phases * double_rows * depth * parallel * columns),
+        bits(new uint8_t[size]()) {}
+    ~PlaneStorage() {
+      delete table;
+      delete [] bits;
+    }
+
+    const int pwm_bits;   // PWM bits to display.
+    const int phases;     // Dither phases; 1 if not dithering.
+    const EncodeTable *const table;   // What the planes are encoded with.
+    const size_t size;    // Bytes in "bits".
+    uint8_t *const bits;
+  };
+  PlaneStorage *planes_;
+
+  // The planes DumpToMatrix() is currently reading, so that they're not
+  // deleted from under its feet while the depth is changed.
+  PlaneStorage *in_dump_;
+  // Announce and withdraw reading the current planes from the refresh.
+  inline PlaneStorage *AcquirePlanes();
+  inline void ReleasePlanes();
+
+  // Bytes from one plane of a double row to the next.
+  inline int PlaneStride() const { return parallel_ * vcolumns_; }
+  inline uint8_t *ValueAt(PlaneStorage *planes,
+                          int double_row, int chain, int column, int bit);
+
+  inline void MarkChanged(int double_row) { dirty_[double_row] = true; }
+  // Same for all stored double rows row "y" is encoded into.
+  void MarkRowChanged(int y);
+  // Clock one plane of a stored row, given by the entries of its first
+  // chain, into the panels, starting at "first_column" and wrapping around.
+  template <class Output>
+  inline void ShiftRow(Output *io, const uint8_t *entries, int first_column);
+  template <class Output>
+  inline void ShiftColumns(Output *io, const uint8_t *entries, int count);
+
+  // Encode "count" pixels of row "y", starting at column "x" into
+  // "planes". Expects the range to be within bounds. Doesn't mark the
+  // row changed.
+  void EncodeRow(PlaneStorage *planes, int y, int x, int count,
+                 const uint8_t *data, int bytes_per_pixel);
+
+  // Encode the whole RGB source into freshly allocated planes of the
+  // given depth with the current curve and make them the current ones.
+  void ReEncode(int pwm_bits);
+  PlaneStorage *NewPlaneStorage(int pwm_bits) const;
+
+  // Dither phases worth keeping at the given PWM depth.
+  int DitherPhases(int pwm_bits) const;
+  // What to add to a mapped color at (x, y) to get the value encoded for
+  // dither "phase".
+  inline int DitherOffset(const PlaneStorage *planes, int phase,
+                          int x, int y) const;
+
+  // The source of truth: what has been set, as 24bpp RGB. The planes are
+  // always the encoding of this with the current settings.
+  uint8_t *rgb_buffer_;
+
+  template <class Output>
+  void DumpPipelined(Output *io, PlaneStorage *planes, int phase,
+                     int first_plane, int brightness, int scroll_x,
+                     int scroll_y, PlaneTiming *timing);
+  void UpdateShiftEstimate(int64_t measured);
+  int64_t shift_nanos_;     // Estimated time to clock in one plane row.
+
+  bool *dirty_;             // Per stored double row.
+
+  // Output bits; the same for every frame, computed once.
+  void InitOutputBits();
+  uint32_t color_clk_mask_;
+  uint32_t clock_bits_;
+  uint32_t output_enable_bits_;
+  uint32_t strobe_bits_;
+  uint32_t *row_select_;    // Clear and set word per double row.
+  // Per chain, the GPIO color bits for each plane entry value.
+  uint32_t expand_[kMaxParallel][64];
+  uint64_t encoded_rows_;
+  uint64_t skipped_rows_;
+
+  const PlaneEncoder &encoder_;  // Bulk encoding, best for this CPU.
+
+  // Scratch space for EncodeRow(): one row worth of mapped colors.
+  uint16_t *row_red_;
+  uint16_t *row_green_;
+  uint16_t *row_blue_;
 };
 }  // namespace rgb_matrix
 #endif // RPI_RGBMATRIX_FRAMEBUFFER_INTERNAL_H
@@ -18,17 +18,22 @@
 // to manipulate the content.
 
 #include "framebuffer-internal.h"
+#include "clip-internal.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <unistd.h>
+#include <vector>
 
 namespace rgb_matrix {
 enum {
-  kBitPlanes = 11  // maximum usable bitplanes.
+  kBitPlanes = 11,  // maximum usable bitplanes.
+  kMaxDitherBits = 4
 };
 
 static const long kBaseTimeNanos = 200;
@@ -59,19 +64,88 @@ static void sleep_nanos(long nanos) {
   }
 }
 
-RGBMatrix::Framebuffer::Framebuffer(int rows, int columns)
+RGBMatrix::Framebuffer::Framebuffer(int rows, int columns, int parallel,
+                                    int virtual_columns, int virtual_height,
+                                    int pwm_bits, const ResponseCurve &curve,
+                                    int dither_bits)
   : rows_(rows), columns_(columns),
-    pwm_bits_(kBitPlanes), do_luminance_correct_(true),
-    double_rows_(rows / 2), row_mask_(double_rows_ - 1) {
-  bitplane_buffer_ = new IoBits [double_rows_ * columns_ * kBitPlanes];
+    parallel_(parallel), height_(rows * parallel),
+    curve_(curve), dither_bits_(dither_bits),
+    double_rows_(rows / 2), row_mask_(double_rows_ - 1),
+    vcolumns_(std::max(columns_, virtual_columns)),
+    vheight_(std::max(height_, virtual_height)),
+    scroll_rows_(vheight_ > height_),
+    stored_rows_(scroll_rows_ ? vheight_ : double_rows_),
+    scroll_offset_(0),
+    planes_(NewPlaneStorage(pwm_bits)),
+    in_dump_(NULL), encoder_(GetPlaneEncoder()) {
+  rgb_buffer_ = new uint8_t [(size_t) vheight_ * vcolumns_ * 3];
+  shift_nanos_ = 0;
+  dirty_ = new bool [stored_rows_];
+  InitOutputBits();
+  encoded_rows_ = skipped_rows_ = 0;
+  row_red_ = new uint16_t [vcolumns_];
+  row_green_ = new uint16_t [vcolumns_];
+  row_blue_ = new uint16_t [vcolumns_];
   Clear();
 }
 
 RGBMatrix::Framebuffer::~Framebuffer() {
-  delete [] bitplane_buffer_;
+  delete planes_;
+  delete [] rgb_buffer_;
+  delete [] dirty_;
+  delete [] row_select_;
+  delete [] row_red_;
+  delete [] row_green_;
+  delete [] row_blue_;
 }
 
-/* statuc */ void RGBMatrix::Framebuffer::InitGPIO(GPIO *io) {
+/* static */ uint32_t RGBMatrix::Framebuffer::ColorBit(int sub_panel,
+                                                      int channel) {
+  IoBits bit;
+  switch (3 * sub_panel + channel) {
+  case 0:  bit.bits.r1 = 1; break;
+  case 1:  bit.bits.g1 = 1; break;
+  case 2:  bit.bits.b1 = 1; break;
+  case 3:  bit.bits.r2 = 1; break;
+  case 4:  bit.bits.g2 = 1; break;
+  case 5:  bit.bits.b2 = 1; break;
+  case 6:  bit.bits.p1_r1 = 1; break;
+  case 7:  bit.bits.p1_g1 = 1; break;
+  case 8:  bit.bits.p1_b1 = 1; break;
+  case 9:  bit.bits.p1_r2 = 1; break;
+  case 10: bit.bits.p1_g2 = 1; break;
+  case 11: bit.bits.p1_b2 = 1; break;
+  case 12: bit.bits.p2_r1 = 1; break;
+  case 13: bit.bits.p2_g1 = 1; break;
+  case 14: bit.bits.p2_b1 = 1; break;
+  case 15: bit.bits.p2_r2 = 1; break;
+  case 16: bit.bits.p2_g2 = 1; break;
+  case 17: bit.bits.p2_b2 = 1; break;
+  }
+  return bit.raw;
+}
+
+/* static */ uint32_t RGBMatrix::Framebuffer::RowAddress(int double_row) {
+  IoBits row_address;
+#ifdef ADAFRUIT_RGBMATRIX_HAT
+  row_address.bits.a = double_row;
+  row_address.bits.b = double_row >> 1;
+  row_address.bits.c = double_row >> 2;
+  row_address.bits.d = double_row >> 3;
+  row_address.bits.e = double_row >> 4;
+#else
+  row_address.bits.row = double_row;
+#endif
+  return row_address.raw;
+}
+
+/* static */ uint32_t RGBMatrix::Framebuffer::RowAddressMask(int double_rows) {
+  return RowAddress(std::max(15, double_rows - 1));
+}
+
+/* statuc */ void RGBMatrix::Framebuffer::InitGPIO(GPIO *io, int rows,
+                                                 int parallel) {
   // Tell GPIO about all bits we intend to use.
   IoBits b;
   b.raw = 0;
@@ -84,143 +158,723 @@ RGBMatrix::Framebuffer::~Framebuffer() {
 #endif
 
   b.bits.strobe = 1;
-  b.bits.r1 = b.bits.g1 = b.bits.b1 = 1;
-  b.bits.r2 = b.bits.g2 = b.bits.b2 = 1;
-#ifdef ADAFRUIT_RGBMATRIX_HAT
-  b.bits.a = b.bits.b = b.bits.c = b.bits.d = 1;
-#else
-  b.bits.row = 0x0f;
-#endif
+  for (int i = 0; i < 6 * parallel; ++i) {
+    b.raw |= ColorBit(i / 3, i % 3);
+  }
+  b.raw |= RowAddressMask(rows / 2);
   // Initialize outputs, make sure that all of these are supported bits.
   const uint32_t result = io->InitOutputs(b.raw);
   printf("Result: 0x%X v 0x%X\n", result, b.raw);
   assert(result == b.raw);
 }
 
+/* static */ void RGBMatrix::Framebuffer::DescribePins(
+  GPIOSimulator::Pins *pins, int rows, int parallel) {
+  IoBits clock, strobe, output_enable;
+#ifdef ADAFRUIT_RGBMATRIX_HAT
+  clock.bits.clock = 1;
+  output_enable.bits.output_enable = 1;
+#else
+  clock.bits.clock_rev1 = clock.bits.clock_rev2 = 1;
+  output_enable.bits.output_enable_rev1 = 1;
+  output_enable.bits.output_enable_rev2 = 1;
+#endif
+  strobe.bits.strobe = 1;
+
+  pins->clock = clock.raw;
+  pins->strobe = strobe.raw;
+  pins->output_enable = output_enable.raw;
+  pins->row_bits = (rows / 2 > 16) ? 5 : 4;
+  for (int i = 0; i < 5; ++i) {
+    pins->row[i] = (i < pins->row_bits) ? RowAddress(1 << i) : 0;
+  }
+  pins->parallel = parallel;
+  for (int i = 0; i < 6 * GPIOSimulator::kMaxParallel; ++i) {
+    pins->color[i / 6][i / 3 % 2][i % 3] =
+      (i < 6 * parallel) ? ColorBit(i / 3, i % 3) : 0;
+  }
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+  pins->inverse_colors = true;
+#else
+  pins->inverse_colors = false;
+#endif
+}
+
 bool RGBMatrix::Framebuffer::SetPWMBits(uint8_t value) {
   if (value < 1 || value > kBitPlanes)
     return false;
-  pwm_bits_ = value;
+  if (value != planes_->pwm_bits) {
+    ReEncode(value);
+  }
+  return true;
+}
+
+void RGBMatrix::Framebuffer::set_luminance_correct(bool on) {
+  const ResponseCurve::Type type =
+    on ? ResponseCurve::kCIE1931 : ResponseCurve::kLinear;
+  if (type == curve_.type)
+    return;
+  curve_.type = type;
+  ReEncode(planes_->pwm_bits);
+}
+
+static bool IsValidCurve(const ResponseCurve &curve) {
+  switch (curve.type) {
+  case ResponseCurve::kLinear:
+  case ResponseCurve::kCIE1931:
+  case ResponseCurve::kTable:
+    break;
+  case ResponseCurve::kGamma:
+    if (!(curve.gamma > 0)) return false;
+    break;
+  default:
+    return false;
+  }
+  for (int c = 0; c < 3; ++c) {
+    if (!(curve.gain[c] >= 0 && curve.gain[c] <= 1)) return false;
+  }
   return true;
 }
 
-inline RGBMatrix::Framebuffer::IoBits *
-RGBMatrix::Framebuffer::ValueAt(int double_row, int column, int bit) {
-  return &bitplane_buffer_[ double_row * (columns_ * kBitPlanes)
-                            + bit * columns_
-                            + column ];
+// Whether the curves map every value the same.
+static bool SameCurve(const ResponseCurve &a, const ResponseCurve &b) {
+  if (a.type != b.type) return false;
+  if (a.type == ResponseCurve::kGamma && a.gamma != b.gamma) return false;
+  if (a.type == ResponseCurve::kTable
+      && memcmp(a.table, b.table, sizeof(a.table)) != 0) return false;
+  return a.gain[0] == b.gain[0] && a.gain[1] == b.gain[1]
+    && a.gain[2] == b.gain[2];
+}
+
+bool RGBMatrix::Framebuffer::SetResponseCurve(const ResponseCurve &curve) {
+  if (!IsValidCurve(curve))
+    return false;
+  if (SameCurve(curve, curve_))
+    return true;
+  curve_ = curve;
+  ReEncode(planes_->pwm_bits);
+  return true;
+}
+
+bool RGBMatrix::Framebuffer::SetDitherBits(uint8_t bits) {
+  if (bits > kMaxDitherBits)
+    return false;
+  if (bits != dither_bits_) {
+    dither_bits_ = bits;
+    if (DitherPhases(planes_->pwm_bits) != planes_->phases)
+      ReEncode(planes_->pwm_bits);
+  }
+  return true;
+}
+
+int RGBMatrix::Framebuffer::DitherPhases(int pwm_bits) const {
+  // There is nothing to recover beyond the planes that are not shown.
+  return 1 << std::min((int) dither_bits_, kBitPlanes - pwm_bits);
+}
+
+RGBMatrix::Framebuffer::PlaneStorage *
+RGBMatrix::Framebuffer::NewPlaneStorage(int pwm_bits) const {
+  // Round to what can be shown: the planes we have plus what dithering
+  // recovers of the ones left out.
+  const int phases = DitherPhases(pwm_bits);
+  const int precision = pwm_bits + __builtin_ctz(phases);
+  return new PlaneStorage(pwm_bits, phases, stored_rows_, parallel_, vcolumns_,
+                          new EncodeTable(curve_, pwm_bits, precision));
+}
+
+void RGBMatrix::Framebuffer::ReEncode(int pwm_bits) {
+  PlaneStorage *const old = planes_;
+  PlaneStorage *const replacement = NewPlaneStorage(pwm_bits);
+  for (int y = 0; y < vheight_; ++y) {
+    EncodeRow(replacement, y, 0, vcolumns_,
+              rgb_buffer_ + 3 * y * vcolumns_, 3);
+  }
+
+  __atomic_store_n(&planes_, replacement, __ATOMIC_SEQ_CST);
+  // If we're being displayed right now, the refresh thread might still be
+  // reading the old planes. Wait until it is done with them.
+  while (__atomic_load_n(&in_dump_, __ATOMIC_SEQ_CST) == old) {
+    usleep(100);
+  }
+  delete old;
+}
+
+inline uint8_t *
+RGBMatrix::Framebuffer::ValueAt(PlaneStorage *planes, int double_row,
+                                int chain, int column, int bit) {
+  const int first_plane = kBitPlanes - planes->pwm_bits;
+  return &planes->bits[ (size_t) double_row * PlaneStride() * planes->pwm_bits
+                        + (bit - first_plane) * PlaneStride()
+                        + chain * vcolumns_
+                        + column ];
+}
+
+// Announce which planes we're reading, so that they are not replaced
+// under our feet. If they changed in the meantime, try again.
+inline RGBMatrix::Framebuffer::PlaneStorage *
+RGBMatrix::Framebuffer::AcquirePlanes() {
+  PlaneStorage *planes;
+  do {
+    planes = __atomic_load_n(&planes_, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&in_dump_, planes, __ATOMIC_SEQ_CST);
+  } while (planes != __atomic_load_n(&planes_, __ATOMIC_SEQ_CST));
+  return planes;
+}
+
+inline void RGBMatrix::Framebuffer::ReleasePlanes() {
+  __atomic_store_n(&in_dump_, (PlaneStorage*) NULL, __ATOMIC_SEQ_CST);
+}
+
+inline int RGBMatrix::Framebuffer::RowTargets(int y, int *stored_row,
+                                              int *sub_panel) const {
+  if (!scroll_rows_) {
+    stored_row[0] = y & row_mask_;
+    sub_panel[0] = SubPanel(y);
+    return 1;
+  }
+  // Sub-panel s of stored row v shows row v + s * double_rows_.
+  for (int s = 0; s < 2 * parallel_; ++s) {
+    stored_row[s] = (y - s * double_rows_ + vheight_) % vheight_;
+    sub_panel[s] = s;
+  }
+  return 2 * parallel_;
+}
+
+void RGBMatrix::Framebuffer::SetScrollOffset(int x, int y) {
+  x %= vcolumns_;
+  if (x < 0) x += vcolumns_;
+  y = scroll_rows_ ? y % vheight_ : 0;
+  if (y < 0) y += vheight_;
+  __atomic_store_n(&scroll_offset_, (uint32_t) y << 16 | x, __ATOMIC_RELAXED);
 }
 
-// Do CIE1931 luminance correction and scale to output bitplanes
-static uint16_t luminance_cie1931(uint8_t c) {
-  float out_factor = ((1 << kBitPlanes) - 1);
-  float v = c * 100.0 / 255.0;
-  return out_factor * ((v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3));
+// Ordered dither matrix. Each 4x4 block of pixels goes through the dither
+// phases at different times, so that not all of them round up at once.
+static const uint8_t kDitherMatrix[4][4] = {
+  {  0,  8,  2, 10 },
+  { 12,  4, 14,  6 },
+  {  3, 11,  1,  9 },
+  { 15,  7, 13,  5 },
+};
+
+inline int RGBMatrix::Framebuffer::DitherOffset(const PlaneStorage *planes,
+                                                int phase,
+                                                int x, int y) const {
+  // Over a cycle, a pixel gets every multiple of the smallest step we can
+  // recover once, which adds a "round up" to the planes shown as often as
+  // the planes left out would have been lit.
+  const int bits = __builtin_ctz(planes->phases);
+  const int start = kDitherMatrix[y & 3][x & 3] >> (kMaxDitherBits - bits);
+  const int step_shift = kBitPlanes - planes->pwm_bits - bits;
+  return ((phase + start) & (planes->phases - 1)) << step_shift;
 }
 
-static uint16_t *CreateLuminanceCIE1931LookupTable() {
-  uint16_t *result = new uint16_t [ 256 ];
-  for (int i = 0; i < 256; ++i)
-    result[i] = luminance_cie1931(i);
+// A mapped color with the dither offset added, saturating at full
+// brightness.
+static inline uint16_t DitherColor(uint16_t mapped, int offset) {
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+  mapped ^= 0xffff;
+#endif
+  const uint16_t result = std::min(mapped + offset, (1 << kBitPlanes) - 1);
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+  return result ^ 0xffff;
+#else
   return result;
+#endif
+}
+
+ResponseCurve::ResponseCurve(Type t) : type(t), gamma(2.2) {
+  for (int v = 0; v < 256; ++v) table[v] = v * 257;
+  gain[0] = gain[1] = gain[2] = 1.0;
+}
+
+// Fraction of the full on-time (0..1) for color value "c".
+static double CurveValue(const ResponseCurve &curve, uint8_t c) {
+  switch (curve.type) {
+  case ResponseCurve::kCIE1931: {
+    const double v = c * 100.0 / 255.0;
+    return (v <= 8) ? v / 902.3 : pow((v + 16) / 116.0, 3);
+  }
+  case ResponseCurve::kGamma:
+    return pow(c / 255.0, curve.gamma);
+  case ResponseCurve::kTable:
+    return curve.table[c] / 65535.0;
+  case ResponseCurve::kLinear:
+  default:
+    return c / 255.0;
+  }
 }
 
-inline uint16_t RGBMatrix::Framebuffer::MapColor(uint8_t c) {
+RGBMatrix::Framebuffer::EncodeTable::EncodeTable(const ResponseCurve &curve,
+                                                 int pwm_bits,
+                                                 int precision) {
+  // Rounded once to the precision shown, then left aligned to the planes.
+  // Rounding at 11 bits and leaving out planes later would always round
+  // down, making everything darker the fewer planes we show. Full on is
+  // all shown planes lit; the extra dither precision is below that.
+  const int max_value = ((1 << pwm_bits) - 1) << (precision - pwm_bits);
+  for (int channel = 0; channel < 3; ++channel) {
+    for (int v = 0; v < 256; ++v) {
+      const double value = CurveValue(curve, v) * curve.gain[channel];
+      const uint16_t out =
+        lround(value * max_value) << (kBitPlanes - precision);
 #ifdef INVERSE_RGB_DISPLAY_COLORS
-#  define COLOR_OUT_BITS(x) (x) ^ 0xffff
+      mapped[channel][v] = out ^ 0xffff;
 #else
-#  define COLOR_OUT_BITS(x) (x)
+      mapped[channel][v] = out;
 #endif
+    }
+  }
 
-  if (do_luminance_correct_) {
-    // We're leaking this table. So be it :)
-    static uint16_t *luminance_lookup = CreateLuminanceCIE1931LookupTable();
-    return COLOR_OUT_BITS(luminance_lookup[c]);
-  } else {
-    enum {shift = kBitPlanes - 8};  //constexpr; shift to be left aligned.
-    return COLOR_OUT_BITS((shift > 0) ? (c << shift) : (c >> -shift));
+  const int first_plane = kBitPlanes - pwm_bits;
+  for (int half = 0; half < 2; ++half) {
+    for (int channel = 0; channel < 3; ++channel) {
+      const uint8_t bit = EntryBit(half, channel);
+      uint8_t *out = new uint8_t[256 * pwm_bits];
+      plane_bits[half][channel] = out;
+      for (int v = 0; v < 256; ++v) {
+        for (int b = first_plane; b < kBitPlanes; ++b) {
+          *out++ = (mapped[channel][v] & (1 << b)) ? bit : 0;
+        }
+      }
+    }
+  }
+}
+
+RGBMatrix::Framebuffer::EncodeTable::~EncodeTable() {
+  for (int half = 0; half < 2; ++half) {
+    for (int channel = 0; channel < 3; ++channel) {
+      delete [] plane_bits[half][channel];
+    }
   }
+}
 
-#undef COLOR_OUT_BITS
+int RGBMatrix::Framebuffer::DirtyDoubleRows() const {
+  int count = 0;
+  for (int row = 0; row < stored_rows_; ++row) {
+    if (dirty_[row]) ++count;
+  }
+  return count;
+}
+
+void RGBMatrix::Framebuffer::MarkClean() {
+  memset(dirty_, 0, stored_rows_ * sizeof(*dirty_));
 }
 
 void RGBMatrix::Framebuffer::Clear() {
 #ifdef INVERSE_RGB_DISPLAY_COLORS
   Fill(0, 0, 0);
 #else
-  memset(bitplane_buffer_, 0,
-         sizeof(*bitplane_buffer_) * double_rows_ * columns_ * kBitPlanes);
+  memset(rgb_buffer_, 0, (size_t) vheight_ * vcolumns_ * 3);
+  memset(planes_->bits, 0, planes_->size);
+  for (int row = 0; row < stored_rows_; ++row) MarkChanged(row);
 #endif
 }
 
 void RGBMatrix::Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(g);
-  const uint16_t blue  = MapColor(b);
-
-  for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
-    uint16_t mask = 1 << b;
-    IoBits plane_bits;
-    plane_bits.raw = 0;
-    plane_bits.bits.r1 = plane_bits.bits.r2 = (red & mask) == mask;
-    plane_bits.bits.g1 = plane_bits.bits.g2 = (green & mask) == mask;
-    plane_bits.bits.b1 = plane_bits.bits.b2 = (blue & mask) == mask;
-    for (int row = 0; row < double_rows_; ++row) {
-      IoBits *row_data = ValueAt(row, 0, b);
-      for (int col = 0; col < columns_; ++col) {
-        (row_data++)->raw = plane_bits.raw;
-      }
+  uint8_t *rgb = rgb_buffer_;
+  for (size_t i = 0; i < (size_t) vheight_ * vcolumns_; ++i) {
+    *rgb++ = r;
+    *rgb++ = g;
+    *rgb++ = b;
+  }
+
+  if (planes_->phases > 1) {
+    // Dithered, each pixel rounds differently; encode like any content.
+    for (int y = 0; y < vheight_; ++y) {
+      EncodeRow(planes_, y, 0, vcolumns_, rgb_buffer_ + 3 * y * vcolumns_, 3);
     }
+    for (int row = 0; row < stored_rows_; ++row) MarkChanged(row);
+    return;
   }
+
+  // For each plane, every entry has the same bits: both halves, all three
+  // colors.
+  const int pwm_bits = planes_->pwm_bits;
+  const EncodeTable *const table = planes_->table;
+  for (int p = 0; p < pwm_bits; ++p) {
+    uint8_t entry = 0;
+    for (int half = 0; half < 2; ++half) {
+      entry |= table->plane_bits[half][0][r * pwm_bits + p]
+        | table->plane_bits[half][1][g * pwm_bits + p]
+        | table->plane_bits[half][2][b * pwm_bits + p];
+    }
+    for (int row = 0; row < stored_rows_; ++row) {
+      memset(ValueAt(planes_, row, 0, 0, kBitPlanes - pwm_bits + p),
+             entry, PlaneStride());
+    }
+  }
+  for (int row = 0; row < stored_rows_; ++row) MarkChanged(row);
 }
 
 void RGBMatrix::Framebuffer::SetPixel(int x, int y,
                                       uint8_t r, uint8_t g, uint8_t b) {
-  if (x < 0 || x >= columns_ || y < 0 || y >= rows_) return;
-
-  const uint16_t red   = MapColor(r);
-  const uint16_t green = MapColor(g);
-  const uint16_t blue  = MapColor(b);
-
-  const int min_bit_plane = kBitPlanes - pwm_bits_;
-  IoBits *bits = ValueAt(y & row_mask_, x, min_bit_plane);
-  if (y < double_rows_) {   // Upper sub-panel.
-    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-      const uint16_t mask = 1 << b;
-      bits->bits.r1 = (red & mask) == mask;
-      bits->bits.g1 = (green & mask) == mask;
-      bits->bits.b1 = (blue & mask) == mask;
-      bits += columns_;
+  if (x < 0 || x >= vcolumns_ || y < 0 || y >= vheight_) return;
+
+  uint8_t *rgb = rgb_buffer_ + 3 * (y * vcolumns_ + x);
+  if (rgb[0] == r && rgb[1] == g && rgb[2] == b)
+    return;  // Nothing changes.
+  rgb[0] = r;
+  rgb[1] = g;
+  rgb[2] = b;
+
+  if (planes_->phases > 1) {
+    // Each dither phase has its own value; not worth a table.
+    EncodeRow(planes_, y, x, 1, rgb, 3);
+    MarkRowChanged(y);
+    return;
+  }
+
+  // Each plane is a matter of ORing the precomputed bits of the three
+  // colors into the entry.
+  int stored_row[2 * kMaxParallel], sub_panels[2 * kMaxParallel];
+  const int targets = RowTargets(y, stored_row, sub_panels);
+  const int pwm_bits = planes_->pwm_bits;
+  const EncodeTable *const table = planes_->table;
+  for (int t = 0; t < targets; ++t) {
+    const int half = sub_panels[t] % 2;
+    const uint8_t *red = table->plane_bits[half][0] + r * pwm_bits;
+    const uint8_t *green = table->plane_bits[half][1] + g * pwm_bits;
+    const uint8_t *blue = table->plane_bits[half][2] + b * pwm_bits;
+    const uint8_t keep = ~(EntryBit(half, 0) | EntryBit(half, 1)
+                           | EntryBit(half, 2));
+    uint8_t *entry = ValueAt(planes_, stored_row[t], sub_panels[t] / 2, x,
+                             kBitPlanes - pwm_bits);
+    for (int p = 0; p < pwm_bits; ++p) {
+      *entry = (*entry & keep) | red[p] | green[p] | blue[p];
+      entry += PlaneStride();
     }
-  } else {
-    for (int b = min_bit_plane; b < kBitPlanes; ++b) {
-      const uint16_t mask = 1 << b;
-      bits->bits.r2 = (red & mask) == mask;
-      bits->bits.g2 = (green & mask) == mask;
-      bits->bits.b2 = (blue & mask) == mask;
-      bits += columns_;
+    MarkChanged(stored_row[t]);
+  }
+}
+
+void RGBMatrix::Framebuffer::SetPixels(int x, int y, int width, int height,
+                                       const uint8_t *data, int stride,
+                                       int bytes_per_pixel) {
+  // Clip once for the whole rectangle.
+  int skip_x, skip_y;
+  if (!ClipRect(vcolumns_, vheight_, &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+  data += skip_y * stride + skip_x * bytes_per_pixel;
+
+  // Often, only a few rows change from frame to frame. Comparing with
+  // the RGB source is a lot cheaper than encoding, so we only encode the
+  // rows that differ.
+  for (int row = y; row < y + height; ++row, data += stride) {
+    uint8_t *rgb = rgb_buffer_ + 3 * (row * vcolumns_ + x);
+    if (bytes_per_pixel == 3) {
+      if (memcmp(rgb, data, 3 * width) == 0) {
+        ++skipped_rows_;
+        continue;
+      }
+      memcpy(rgb, data, 3 * width);
+    } else {
+      bool changed = false;
+      for (int i = 0; i < width; ++i, rgb += 3) {
+        const uint8_t *pixel = data + i * bytes_per_pixel;
+        if (rgb[0] != pixel[0] || rgb[1] != pixel[1] || rgb[2] != pixel[2]) {
+          changed = true;
+          rgb[0] = pixel[0];
+          rgb[1] = pixel[1];
+          rgb[2] = pixel[2];
+        }
+      }
+      if (!changed) {
+        ++skipped_rows_;
+        continue;
+      }
+    }
+    EncodeRow(planes_, row, x, width, data, bytes_per_pixel);
+    MarkRowChanged(row);
+    ++encoded_rows_;
+  }
+}
+
+void RGBMatrix::Framebuffer::FillRect(int x, int y, int width, int height,
+                                      uint8_t r, uint8_t g, uint8_t b) {
+  int skip_x, skip_y;
+  if (!ClipRect(vcolumns_, vheight_, &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+
+  if (planes_->phases > 1) {
+    // Dithered, each pixel rounds differently; encode like any content:
+    // one row of the color, used for every row.
+    std::vector<uint8_t> row(3 * width);
+    for (int i = 0; i < width; ++i) {
+      row[3 * i] = r;
+      row[3 * i + 1] = g;
+      row[3 * i + 2] = b;
+    }
+    SetPixels(x, y, width, height, &row[0], 0, 3);
+    return;
+  }
+
+  // Like SetPixel(), but a plane has the same bits all along the span.
+  const int pwm_bits = planes_->pwm_bits;
+  const EncodeTable *const table = planes_->table;
+  for (int row = y; row < y + height; ++row) {
+    uint8_t *rgb = rgb_buffer_ + 3 * (row * vcolumns_ + x);
+    bool changed = false;
+    for (int i = 0; i < width; ++i, rgb += 3) {
+      if (rgb[0] != r || rgb[1] != g || rgb[2] != b) {
+        changed = true;
+        rgb[0] = r;
+        rgb[1] = g;
+        rgb[2] = b;
+      }
+    }
+    if (!changed) {
+      ++skipped_rows_;
+      continue;
+    }
+
+    int stored_row[2 * kMaxParallel], sub_panels[2 * kMaxParallel];
+    const int targets = RowTargets(row, stored_row, sub_panels);
+    for (int t = 0; t < targets; ++t) {
+      const int half = sub_panels[t] % 2;
+      const uint8_t *red = table->plane_bits[half][0] + r * pwm_bits;
+      const uint8_t *green = table->plane_bits[half][1] + g * pwm_bits;
+      const uint8_t *blue = table->plane_bits[half][2] + b * pwm_bits;
+      const uint8_t keep = ~(EntryBit(half, 0) | EntryBit(half, 1)
+                             | EntryBit(half, 2));
+      uint8_t *entries = ValueAt(planes_, stored_row[t], sub_panels[t] / 2,
+                                 x, kBitPlanes - pwm_bits);
+      for (int p = 0; p < pwm_bits; ++p, entries += PlaneStride()) {
+        const uint8_t bits = red[p] | green[p] | blue[p];
+        for (int i = 0; i < width; ++i) {
+          entries[i] = (entries[i] & keep) | bits;
+        }
+      }
+      MarkChanged(stored_row[t]);
+    }
+    ++encoded_rows_;
+  }
+}
+
+static inline bool IsColorKey(const uint8_t *pixel, const uint8_t *key) {
+  return pixel[0] == key[0] && pixel[1] == key[1] && pixel[2] == key[2];
+}
+
+void RGBMatrix::Framebuffer::Blit(int x, int y, int width, int height,
+                                  const uint8_t *data, int stride,
+                                  const uint8_t *color_key) {
+  if (color_key == NULL) {
+    SetPixels(x, y, width, height, data, stride, 3);
+    return;
+  }
+  int skip_x, skip_y;
+  if (!ClipRect(vcolumns_, vheight_, &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+  data += skip_y * stride + 3 * skip_x;
+
+  // The pixels that are not transparent go into the RGB source; then the
+  // span from the first to the last one that changed is encoded from
+  // there, once per row.
+  for (int row = y; row < y + height; ++row, data += stride) {
+    uint8_t *const rgb = rgb_buffer_ + 3 * (row * vcolumns_ + x);
+    int first = width, last = -1;
+    for (int i = 0; i < width; ++i) {
+      const uint8_t *pixel = data + 3 * i;
+      uint8_t *out = rgb + 3 * i;
+      if (IsColorKey(pixel, color_key)
+          || (out[0] == pixel[0] && out[1] == pixel[1] && out[2] == pixel[2]))
+        continue;
+      out[0] = pixel[0];
+      out[1] = pixel[1];
+      out[2] = pixel[2];
+      first = std::min(first, i);
+      last = i;
     }
+    if (last < 0) {
+      ++skipped_rows_;
+      continue;
+    }
+    EncodeRow(planes_, row, x + first, last - first + 1, rgb + 3 * first, 3);
+    MarkRowChanged(row);
+    ++encoded_rows_;
+  }
+}
+
+bool RGBMatrix::Framebuffer::GetPixel(int x, int y, uint8_t *red,
+                                      uint8_t *green, uint8_t *blue) const {
+  if (x < 0 || y < 0 || x >= vcolumns_ || y >= vheight_) return false;
+  const uint8_t *rgb = rgb_buffer_ + 3 * (y * vcolumns_ + x);
+  *red = rgb[0];
+  *green = rgb[1];
+  *blue = rgb[2];
+  return true;
+}
+
+void RGBMatrix::Framebuffer::GetPixels(int x, int y, int width, int height,
+                                       uint8_t *data, int stride,
+                                       int bytes_per_pixel) const {
+  int skip_x, skip_y;
+  if (!ClipRect(vcolumns_, vheight_, &x, &y, &width, &height,
+                &skip_x, &skip_y))
+    return;
+  data += skip_y * stride + skip_x * bytes_per_pixel;
+
+  for (int row = y; row < y + height; ++row, data += stride) {
+    const uint8_t *rgb = rgb_buffer_ + 3 * (row * vcolumns_ + x);
+    if (bytes_per_pixel == 3) {
+      memcpy(data, rgb, 3 * width);
+      continue;
+    }
+    uint8_t *pixel = data;
+    for (int i = 0; i < width; ++i, rgb += 3, pixel += bytes_per_pixel) {
+      pixel[0] = rgb[0];
+      pixel[1] = rgb[1];
+      pixel[2] = rgb[2];
+    }
+  }
+}
+
+void RGBMatrix::Framebuffer::GetShownPixels(uint8_t *data, int stride,
+                                            int bytes_per_pixel) const {
+  const int x = scroll_x(), y = scroll_y();
+  const int left = std::min(columns_, vcolumns_ - x);  // Before wrapping.
+  for (int row = 0; row < height_; ++row, data += stride) {
+    const int source = (y + row) % vheight_;
+    GetPixels(x, source, left, 1, data, stride, bytes_per_pixel);
+    if (left < columns_) {
+      GetPixels(0, source, columns_ - left, 1,
+                data + left * bytes_per_pixel, stride, bytes_per_pixel);
+    }
+  }
+}
+
+void RGBMatrix::Framebuffer::EncodeRow(PlaneStorage *planes,
+                                       int y, int x, int count,
+                                       const uint8_t *data,
+                                       int bytes_per_pixel) {
+  // Instead of going through the planes for each pixel, we prepare the
+  // masks of the half we're in and let the plane encoder transpose a whole
+  // run of pixels at once into the entries of the sub-panel's chain.
+  int stored_row[2 * kMaxParallel], sub_panels[2 * kMaxParallel];
+  const int targets = RowTargets(y, stored_row, sub_panels);
+  const int first_plane = kBitPlanes - planes->pwm_bits;
+  const EncodeTable *const table = planes->table;
+  for (int phase = 0; phase < planes->phases; ++phase) {
+    const uint8_t *pixel = data;
+    if (planes->phases == 1) {
+      for (int i = 0; i < count; ++i, pixel += bytes_per_pixel) {
+        row_red_[i]   = table->mapped[0][pixel[0]];
+        row_green_[i] = table->mapped[1][pixel[1]];
+        row_blue_[i]  = table->mapped[2][pixel[2]];
+      }
+    } else {
+      for (int i = 0; i < count; ++i, pixel += bytes_per_pixel) {
+        const int offset = DitherOffset(planes, phase, x + i, y);
+        row_red_[i]   = DitherColor(table->mapped[0][pixel[0]], offset);
+        row_green_[i] = DitherColor(table->mapped[1][pixel[1]], offset);
+        row_blue_[i]  = DitherColor(table->mapped[2][pixel[2]], offset);
+      }
+    }
+    for (int t = 0; t < targets; ++t) {
+      const int half = sub_panels[t] % 2;
+      const PlaneBitMasks masks = { EntryBit(half, 0), EntryBit(half, 1),
+                                    EntryBit(half, 2) };
+      const int phase_row = phase * stored_rows_ + stored_row[t];
+      encoder_.encode(row_red_, row_green_, row_blue_, count, masks,
+                      first_plane, kBitPlanes,
+                      ValueAt(planes, phase_row, sub_panels[t] / 2, x,
+                              first_plane),
+                      PlaneStride());
+    }
+  }
+}
+
+void RGBMatrix::Framebuffer::MarkRowChanged(int y) {
+  int stored_row[2 * kMaxParallel], sub_panels[2 * kMaxParallel];
+  const int targets = RowTargets(y, stored_row, sub_panels);
+  for (int t = 0; t < targets; ++t) MarkChanged(stored_row[t]);
+}
+
+static inline int64_t GetNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Clock columns of one bitplane row into the shift registers of the
+// panels, expanding the entries of each chain into their GPIO color bits.
+// This does not touch output-enable, so it can happen while the previously
+// latched plane is lit. The number of chains is a template parameter so
+// that the loop is straight for each.
+template <int kParallel, class Output>
+static inline void ShiftEntries(Output *io, const uint8_t *entries,
+                                int stride, int count,
+                                const uint32_t (*expand)[64],
+                                uint32_t color_clk_mask, uint32_t clock) {
+  for (int col = 0; col < count; ++col, ++entries) {
+    uint32_t color = expand[0][entries[0]];
+    if (kParallel > 1) color |= expand[1][entries[stride]];
+    if (kParallel > 2) color |= expand[2][entries[2 * stride]];
+    io->ClearBits(~color & color_clk_mask);   // Previous color + reset clock.
+    io->SetBits(color);                       // This column's color.
+    io->SetBits(clock);                       // Rising edge: clock color in.
   }
 }
 
-void RGBMatrix::Framebuffer::DumpToMatrix(GPIO *io) {
+template <class Output>
+inline void RGBMatrix::Framebuffer::ShiftColumns(Output *io,
+                                                 const uint8_t *entries,
+                                                 int count) {
+  switch (parallel_) {
+  case 1:
+    ShiftEntries<1>(io, entries, vcolumns_, count, expand_,
+                    color_clk_mask_, clock_bits_);
+    break;
+  case 2:
+    ShiftEntries<2>(io, entries, vcolumns_, count, expand_,
+                    color_clk_mask_, clock_bits_);
+    break;
+  default:
+    ShiftEntries<3>(io, entries, vcolumns_, count, expand_,
+                    color_clk_mask_, clock_bits_);
+    break;
+  }
+}
+
+// The first column clocked in ends up leftmost, so a scroll window starts
+// at the horizontal offset and wraps around to the start of the row. The
+// clear words don't depend on the previous column, so that is seamless.
+template <class Output>
+inline void RGBMatrix::Framebuffer::ShiftRow(Output *io,
+                                             const uint8_t *entries,
+                                             int first_column) {
+  const int left = vcolumns_ - first_column;  // Before wrapping around.
+  ShiftColumns(io, entries + first_column, std::min(left, columns_));
+  if (left < columns_)
+    ShiftColumns(io, entries, columns_ - left);
+  io->ClearBits(color_clk_mask_);   // clock back to normal.
+}
+
+void RGBMatrix::Framebuffer::UpdateShiftEstimate(int64_t measured) {
+  // Go up immediately, as underestimating stretches the plane we show
+  // while shifting; come down slowly so that a single lucky
+  // measurement doesn't make us too optimistic.
+  if (measured > shift_nanos_ || shift_nanos_ == 0)
+    shift_nanos_ = measured;
+  else
+    shift_nanos_ -= (shift_nanos_ - measured) / 16;
+}
+
+void RGBMatrix::Framebuffer::InitOutputBits() {
   IoBits color_clk_mask;   // Mask of bits we need to set while clocking in.
-  color_clk_mask.bits.r1 = color_clk_mask.bits.g1 = color_clk_mask.bits.b1 = 1;
-  color_clk_mask.bits.r2 = color_clk_mask.bits.g2 = color_clk_mask.bits.b2 = 1;
+  for (int i = 0; i < 6 * parallel_; ++i) {
+    color_clk_mask.raw |= ColorBit(i / 3, i % 3);
+  }
 #ifdef ADAFRUIT_RGBMATRIX_HAT
   color_clk_mask.bits.clock = 1;
 #else
   color_clk_mask.bits.clock_rev1 = color_clk_mask.bits.clock_rev2 = 1;
 #endif
 
-  IoBits row_mask;
-#ifdef ADAFRUIT_RGBMATRIX_HAT
-  row_mask.bits.a = row_mask.bits.b = row_mask.bits.c = row_mask.bits.d = 1;
-#else
-  row_mask.bits.row = 0x0f;
-#endif
-
-  IoBits clock, output_enable, strobe, row_address;
+  IoBits clock, output_enable, strobe;
 #ifdef ADAFRUIT_RGBMATRIX_HAT
   clock.bits.clock = 1;
   output_enable.bits.output_enable = 1;
@@ -231,40 +885,222 @@ void RGBMatrix::Framebuffer::DumpToMatrix(GPIO *io) {
 #endif
   strobe.bits.strobe = 1;
 
-  const int pwm_to_show = pwm_bits_;  // Local copy, might change in process.
-  for (uint8_t d_row = 0; d_row < double_rows_; ++d_row) {
-#ifdef ADAFRUIT_RGBMATRIX_HAT
-    row_address.bits.a = d_row;
-    row_address.bits.b = d_row >> 1;
-    row_address.bits.c = d_row >> 2;
-    row_address.bits.d = d_row >> 3;
-#else
-    row_address.bits.row = d_row;
-#endif
-    io->WriteMaskedBits(row_address.raw, row_mask.raw);  // Set row address
+  color_clk_mask_ = color_clk_mask.raw;
+  clock_bits_ = clock.raw;
+  output_enable_bits_ = output_enable.raw;
+  strobe_bits_ = strobe.raw;
+
+  // What each plane entry value stands for on each chain.
+  for (int chain = 0; chain < kMaxParallel; ++chain) {
+    for (int value = 0; value < 64; ++value) {
+      expand_[chain][value] = 0;
+      for (int bit = 0; bit < 6; ++bit) {
+        if (chain < parallel_ && (value & (1 << bit)))
+          expand_[chain][value] |= ColorBit(2 * chain + bit / 3, bit % 3);
+      }
+    }
+  }
+
+  // Row select as the words to clear and set.
+  const uint32_t row_mask = RowAddressMask(double_rows_);
+  row_select_ = new uint32_t [2 * double_rows_];
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    const uint32_t row_address = RowAddress(d_row);
+    row_select_[2 * d_row] = ~row_address & row_mask;
+    row_select_[2 * d_row + 1] = row_address & row_mask;
+  }
+}
+
+template <class Output>
+void RGBMatrix::Framebuffer::DumpToMatrix(Output *io,
+                                          const OutputOptions &options,
+                                          PlaneTiming *timing) {
+  PlaneStorage *const planes = AcquirePlanes();
+
+  // We might be asked to show less than we have; then we leave out the
+  // least significant planes.
+  const int pwm_to_show = std::min((int) planes->pwm_bits, options.pwm_bits);
+  const int first_plane = kBitPlanes - std::max(pwm_to_show, 1);
+
+  // Dithering: successive refreshes cycle through the phases.
+  const int phase = options.refresh % planes->phases;
+
+  // The same scroll offset for the whole refresh.
+  const uint32_t offset = ScrollOffset();
+  const int scroll_x = offset & 0xffff;
+  const int scroll_y = offset >> 16;
+
+  if (options.pipelined) {
+    DumpPipelined(io, planes, phase, first_plane, options.brightness,
+                  scroll_x, scroll_y, timing);
+    ReleasePlanes();
+    return;
+  }
+
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    io->ClearBits(row_select_[2 * d_row]);   // Set row address
+    io->SetBits(row_select_[2 * d_row + 1]);
 
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
-    for (int b = kBitPlanes - pwm_to_show; b < kBitPlanes; ++b) {
-      IoBits *row_data = ValueAt(d_row, 0, b);
+    const int stored_row = (d_row + scroll_y) % stored_rows_;
+    const uint8_t *entries =
+      ValueAt(planes, phase * stored_rows_ + stored_row, 0, 0, first_plane);
+    for (int b = first_plane; b < kBitPlanes; ++b) {
       // We clock these in while we are dark. This actually increases the
       // dark time, but we ignore that a bit.
-      for (int col = 0; col < columns_; ++col) {
-        const IoBits &out = *row_data++;
-        io->WriteMaskedBits(out.raw, color_clk_mask.raw);  // col + reset clock
-        io->SetBits(clock.raw);               // Rising edge: clock color in.
+      ShiftRow(io, entries, scroll_x);
+      entries += PlaneStride();
+
+      io->SetBits(strobe_bits_);   // Strobe in the previously clocked in row.
+      io->ClearBits(strobe_bits_);
+
+      // Now switch on for the sleep time necessary for that bit-plane.
+      // Brightness scales all of them alike, so colors stay the same. The
+      // rest of the time we stay dark, so that the refresh rate doesn't
+      // change and the brightness is proportional.
+      const long full_time = kBaseTimeNanos << b;
+      const long on_time = full_time * options.brightness / 100;
+      if (on_time > 0) {
+        const int64_t start = timing ? GetNanos() : 0;
+        io->ClearBits(output_enable_bits_);
+        sleep_nanos(on_time);
+        io->SetBits(output_enable_bits_);
+        if (timing)
+          timing->Record(b, GetNanos() - start, on_time);
       }
+      if (on_time < full_time)
+        sleep_nanos(full_time - on_time);
+    }
+  }
+
+  ReleasePlanes();
+}
 
-      io->ClearBits(color_clk_mask.raw);    // clock back to normal.
+void RGBMatrix::Framebuffer::EmulateRefresh(uint16_t *lit,
+                                            const OutputOptions &options) {
+  PlaneStorage *const planes = AcquirePlanes();
+  // The same choices as DumpToMatrix().
+  const int pwm_to_show = std::min((int) planes->pwm_bits, options.pwm_bits);
+  const int first_plane = kBitPlanes - std::max(pwm_to_show, 1);
+  const int phase = options.refresh % planes->phases;
+  const uint32_t offset = ScrollOffset();
+  const int scroll_x = offset & 0xffff;
+  const int scroll_y = offset >> 16;
 
-      io->SetBits(strobe.raw);   // Strobe in the previously clocked in row.
-      io->ClearBits(strobe.raw);
+  // Plane b is lit for 2^b time units; a refresh of a row takes as long as
+  // all shown planes together, lit or not.
+  const uint64_t period = 100 * ((1 << kBitPlanes) - (1 << first_plane));
+  const uint64_t scale = 65535ULL * options.brightness;
 
-      // Now switch on for the sleep time necessary for that bit-plane.
-      io->ClearBits(output_enable.raw);
-      sleep_nanos(kBaseTimeNanos << b);
-      io->SetBits(output_enable.raw);
+  for (int y = 0; y < height_; ++y) {
+    const int half = (y % rows_) < double_rows_ ? 0 : 1;
+    const int stored_row = ((y % rows_) % double_rows_ + scroll_y)
+      % stored_rows_;
+    const uint8_t *entries = ValueAt(planes, phase * stored_rows_ + stored_row,
+                                     y / rows_, 0, first_plane);
+    for (int x = 0; x < columns_; ++x, lit += 3) {
+      const int column = (x + scroll_x) % vcolumns_;
+      uint32_t on_time[3] = { 0, 0, 0 };
+      for (int b = first_plane; b < kBitPlanes; ++b) {
+        uint8_t entry = entries[(b - first_plane) * PlaneStride() + column];
+#ifdef INVERSE_RGB_DISPLAY_COLORS
+        entry = ~entry;
+#endif
+        for (int channel = 0; channel < 3; ++channel) {
+          if (entry & EntryBit(half, channel))
+            on_time[channel] += 1 << b;
+        }
+      }
+      for (int channel = 0; channel < 3; ++channel) {
+        lit[channel] = (on_time[channel] * scale + period / 2) / period;
+      }
     }
   }
+
+  ReleasePlanes();
 }
+
+// The panels latch on strobe and only show what is latched, so the next
+// plane can be clocked into the shift registers while the current one is
+// lit. Planes are shown in the same order as in DumpToMatrix(); plane N+1
+// (or the first plane of the next row) is shifted while plane N is on.
+//
+// Timing model: plane b has to be lit for exactly kBaseTimeNanos << b
+// (scaled by brightness).
+// Shifting a plane takes shift_nanos_ (measured, it depends on the chain
+// length and GPIO write cycles). If the current plane is at least that
+// long, we shift during its on-time and sleep for the remainder. Shorter
+// planes can't hide a shift without being stretched, so for them we fall
+// back to showing them first and shifting in the dark afterwards. Rows are
+// only switched while dark.
+template <class Output>
+void RGBMatrix::Framebuffer::DumpPipelined(Output *io, PlaneStorage *planes,
+                                           int phase, int first_plane,
+                                           int brightness, int scroll_x,
+                                           int scroll_y,
+                                           PlaneTiming *timing) {
+  const int phase_base = phase * stored_rows_;
+  int64_t start = GetNanos();
+  ShiftRow(io, ValueAt(planes, phase_base + scroll_y % stored_rows_, 0, 0,
+                       first_plane), scroll_x);
+  UpdateShiftEstimate(GetNanos() - start);
+
+  for (int d_row = 0; d_row < double_rows_; ++d_row) {
+    io->ClearBits(row_select_[2 * d_row]);   // We're dark here.
+    io->SetBits(row_select_[2 * d_row + 1]);
+
+    const int row = phase_base + (d_row + scroll_y) % stored_rows_;
+    const int next_row = phase_base + (d_row + 1 + scroll_y) % stored_rows_;
+    for (int b = first_plane; b < kBitPlanes; ++b) {
+      const uint8_t *next = NULL;   // What to shift in while we are lit.
+      if (b + 1 < kBitPlanes)
+        next = ValueAt(planes, row, 0, 0, b + 1);
+      else if (d_row + 1 < double_rows_)
+        next = ValueAt(planes, next_row, 0, 0, first_plane);
+
+      io->SetBits(strobe_bits_);   // Latch what we shifted in before.
+      io->ClearBits(strobe_bits_);
+
+      // With reduced brightness, the plane is lit for a fraction of its
+      // time and we stay dark for the rest of the time it would take at
+      // full brightness, so the refresh rate doesn't change.
+      const long full_time = kBaseTimeNanos << b;
+      const long on_time = full_time * brightness / 100;
+      const int64_t slot_time = (next == NULL || full_time >= shift_nanos_)
+        ? full_time : full_time + shift_nanos_;
+      const int64_t slot_start = GetNanos();
+      if (on_time > 0) io->ClearBits(output_enable_bits_);
+      if (next != NULL && shift_nanos_ > 0 && on_time >= shift_nanos_) {
+        ShiftRow(io, next, scroll_x);
+        const int64_t shift_time = GetNanos() - slot_start;
+        if (shift_time < on_time)
+          sleep_nanos(on_time - shift_time);
+        io->SetBits(output_enable_bits_);
+        if (timing) timing->Record(b, GetNanos() - slot_start, on_time);
+        UpdateShiftEstimate(shift_time);
+      } else {
+        if (on_time > 0) {
+          sleep_nanos(on_time);
+          io->SetBits(output_enable_bits_);
+          if (timing) timing->Record(b, GetNanos() - slot_start, on_time);
+        }
+        if (next != NULL) {
+          start = GetNanos();
+          ShiftRow(io, next, scroll_x);
+          UpdateShiftEstimate(GetNanos() - start);
+        }
+      }
+      const int64_t elapsed = GetNanos() - slot_start;
+      if (on_time < full_time && elapsed < slot_time)
+        sleep_nanos(slot_time - elapsed);
+    }
+  }
+}
+
+// The outputs we support.
+template void RGBMatrix::Framebuffer::DumpToMatrix<GPIO>(
+  GPIO *, const OutputOptions &, PlaneTiming *);
+template void RGBMatrix::Framebuffer::DumpToMatrix<GPIOSimulator>(
+  GPIOSimulator *, const OutputOptions &, PlaneTiming *);
 }  // namespace rgb_matrix
@@ -0,0 +1,191 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "gpio-simulator.h"
+
+#include <algorithm>
+#include <string.h>
+
+namespace rgb_matrix {
+GPIOSimulator::GPIOSimulator(int capacity)
+  : written_(0), double_rows_(0), columns_(0) {
+  int size = 1;
+  while (size < capacity) size <<= 1;
+  ring_.resize(size);
+  mask_ = size - 1;
+  memset(&pins_, 0, sizeof(pins_));
+}
+
+void GPIOSimulator::Configure(const Pins &pins, int double_rows, int columns) {
+  pins_ = pins;
+  double_rows_ = double_rows;
+  columns_ = columns;
+}
+
+int GPIOSimulator::event_count() const {
+  return written_ < ring_.size() ? written_ : ring_.size();
+}
+
+const GPIOSimulator::Event &GPIOSimulator::event(int i) const {
+  return ring_[(written_ - event_count() + i) & mask_];
+}
+
+int GPIOSimulator::Replay(std::vector<LitPhase> *phases) const {
+  if (columns_ == 0) return 0;  // Not configured.
+
+  // The chain of shift registers; new values enter at the end, so after
+  // clocking in a full row, the first value clocked is in front.
+  std::vector<uint32_t> shift(columns_);
+  int shift_head = 0;
+  std::vector<uint32_t> latch(columns_);
+
+  const int color_bits = 6 * pins_.parallel;
+  uint32_t color_mask = 0;
+  for (int c = 0; c < color_bits; ++c) color_mask |= ColorPin(c);
+  const uint32_t invert = pins_.inverse_colors ? color_mask : 0;
+
+  uint32_t state = pins_.output_enable;   // Assume we start dark.
+  int last_row = -1;
+  int plane = 0;
+  const size_t first_phase = phases->size();
+  const int count = event_count();
+  for (int i = 0; i < count; ++i) {
+    const Event &e = event(i);
+    const uint32_t next = e.set ? (state | e.bits) : (state & ~e.bits);
+    const uint32_t rising = ~state & next;
+
+    if (rising & pins_.clock) {
+      const uint32_t colors = next ^ invert;
+      uint32_t value = 0;
+      for (int c = 0; c < color_bits; ++c) {
+        if (colors & ColorPin(c)) value |= 1 << c;
+      }
+      shift[shift_head] = value;
+      shift_head = (shift_head + 1) % columns_;
+    }
+    if (rising & pins_.strobe) {
+      for (int c = 0; c < columns_; ++c)
+        latch[c] = shift[(shift_head + c) % columns_];
+    }
+    if ((state & pins_.output_enable) && !(next & pins_.output_enable)) {
+      int row = 0;
+      for (int b = 0; b < pins_.row_bits; ++b) {
+        if (next & pins_.row[b]) row |= 1 << b;
+      }
+      plane = (row == last_row) ? plane + 1 : 0;
+      last_row = row;
+      LitPhase phase;
+      phase.start_nanos = e.nanos;
+      phase.duration_nanos = 0;
+      phase.double_row = row;
+      phase.plane = plane;
+      phase.colors = latch;
+      phases->push_back(phase);
+    }
+    if (!(state & pins_.output_enable) && (next & pins_.output_enable)
+        && phases->size() > first_phase) {
+      LitPhase &phase = phases->back();
+      phase.duration_nanos = e.nanos - phase.start_nanos;
+    }
+    state = next;
+  }
+
+  // Still lit at the end of the recording: count up to the last write.
+  if (!(state & pins_.output_enable) && phases->size() > first_phase) {
+    LitPhase &phase = phases->back();
+    phase.duration_nanos = event(count - 1).nanos - phase.start_nanos;
+  }
+  return phases->size() - first_phase;
+}
+
+bool GPIOSimulator::LastRowRefreshes(
+  std::vector<std::vector<LitPhase> > *rows) const {
+  std::vector<LitPhase> phases;
+  Replay(&phases);
+  rows->clear();
+  rows->resize(double_rows_);
+
+  // A row refresh is complete once we see the next row start. If the ring
+  // buffer wrapped around, the first one might be missing its beginning.
+  size_t begin = 0;
+  if (written_ > ring_.size()) {
+    while (begin < phases.size() && phases[begin].plane != 0) ++begin;
+  }
+  for (size_t end = begin + 1; end < phases.size(); ++end) {
+    if (phases[end].plane != 0) continue;
+    const int row = phases[begin].double_row;
+    if (row < double_rows_) {
+      (*rows)[row].assign(phases.begin() + begin, phases.begin() + end);
+    }
+    begin = end;
+  }
+  for (int r = 0; r < double_rows_; ++r) {
+    if ((*rows)[r].empty()) return false;
+  }
+  return true;
+}
+
+bool GPIOSimulator::ReconstructPlane(int plane, uint8_t *rgb) const {
+  std::vector<std::vector<LitPhase> > rows;
+  LastRowRefreshes(&rows);
+  for (int r = 0; r < double_rows_; ++r) {
+    if ((int) rows[r].size() <= plane) return false;
+    const LitPhase &phase = rows[r][plane];
+    for (int sub_panel = 0; sub_panel < 2 * pins_.parallel; ++sub_panel) {
+      uint8_t *out = rgb + 3 * columns_ * (r + sub_panel * double_rows_);
+      for (int c = 0; c < columns_; ++c) {
+        for (int color = 0; color < 3; ++color) {
+          *out++ = (phase.colors[c] & (1 << (3 * sub_panel + color)))
+            ? 255 : 0;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+bool GPIOSimulator::ReconstructImage(uint8_t *rgb) const {
+  std::vector<std::vector<LitPhase> > rows;
+  if (!LastRowRefreshes(&rows))
+    return false;
+  const int color_bits = 6 * pins_.parallel;
+  std::vector<int64_t> lit(color_bits * columns_);
+  for (int r = 0; r < double_rows_; ++r) {
+    std::fill(lit.begin(), lit.end(), 0);
+    int64_t total = 0;
+    for (size_t p = 0; p < rows[r].size(); ++p) {
+      const LitPhase &phase = rows[r][p];
+      total += phase.duration_nanos;
+      for (int c = 0; c < columns_; ++c) {
+        for (int bit = 0; bit < color_bits; ++bit) {
+          if (phase.colors[c] & (1 << bit))
+            lit[color_bits * c + bit] += phase.duration_nanos;
+        }
+      }
+    }
+    if (total == 0) total = 1;
+    for (int sub_panel = 0; sub_panel < 2 * pins_.parallel; ++sub_panel) {
+      uint8_t *out = rgb + 3 * columns_ * (r + sub_panel * double_rows_);
+      for (int c = 0; c < columns_; ++c) {
+        for (int color = 0; color < 3; ++color) {
+          const int64_t on = lit[color_bits * c + 3 * sub_panel + color];
+          *out++ = (255 * on + total / 2) / total;
+        }
+      }
+    }
+  }
+  return true;
+}
+}  // namespace rgb_matrix
@@ -15,66 +15,487 @@
 
 #include "led-matrix.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <math.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
 
-#define SHOW_REFRESH_RATE 0
-
-#if SHOW_REFRESH_RATE
-# include <stdio.h>
-# include <sys/time.h>
-#endif
-
+#include "content-stream.h"
 #include "gpio.h"
+#include "gpio-simulator.h"
+#include "virtual-display.h"
 #include "thread.h"
 #include "framebuffer-internal.h"
 
 namespace rgb_matrix {
 
+static inline int64_t GetNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 // Pump pixels to screen. Needs to be high priority real-time because jitter
 class RGBMatrix::UpdateThread : public Thread {
 public:
-  UpdateThread(RGBMatrix *matrix) : running_(true), matrix_(matrix) {}
+  UpdateThread(FrameCanvas *initial_frame)
+    : running_(true), io_(NULL), simulator_(NULL), display_(NULL),
+      pipelined_(false),
+      brightness_(100),
+      min_refresh_hz_(0), shown_pwm_bits_(RefreshStats::kMaxPlanes),
+      previous_start_(0), window_sum_(0), window_count_(0), refreshes_(0),
+      refresh_count_(0), refresh_waiters_(0), event_fd_(-1),
+      current_frame_(initial_frame), next_frame_(NULL), published_(0),
+      stats_sequence_(0), last_start_(0), last_lit_(0), reset_generation_(0),
+      deadline_(0) {
+    pthread_cond_init(&frame_done_, NULL);
+    pthread_cond_init(&refresh_done_, NULL);
+    memset(measured_period_, 0, sizeof(measured_period_));
+    memset(measured_at_, 0, sizeof(measured_at_));
+  }
+  virtual ~UpdateThread() {
+    if (event_fd_ >= 0) close(event_fd_);
+    pthread_cond_destroy(&refresh_done_);
+    pthread_cond_destroy(&frame_done_);
+  }
+
+  // Refresh to whichever of "io", "simulator" and "display" is not NULL.
+  void Start(GPIO *io, GPIOSimulator *simulator, VirtualDisplay *display,
+             const ThreadOptions &options) {
+    io_ = io;
+    simulator_ = simulator;
+    display_ = display;
+    if (display_ != NULL)
+      lit_.resize(3 * display_->width() * display_->height());
+    Thread::Start(options);
+  }
 
   void Stop() {
-    MutexLock l(&mutex_);
-    running_ = false;
+    __atomic_store_n(&running_, false, __ATOMIC_RELEASE);
+  }
+
+  // Picked up with the next refresh.
+  void set_pipelined(bool on) {
+    __atomic_store_n(&pipelined_, on, __ATOMIC_RELAXED);
+  }
+  bool pipelined() const {
+    return __atomic_load_n(&pipelined_, __ATOMIC_RELAXED);
+  }
+
+  // Percent of the full on-time; picked up with the next refresh.
+  void set_brightness(int percent) {
+    __atomic_store_n(&brightness_, percent, __ATOMIC_RELAXED);
+  }
+  int brightness() const {
+    return __atomic_load_n(&brightness_, __ATOMIC_RELAXED);
+  }
+
+  // Adapt the number of planes shown to stay above this refresh rate.
+  // 0 switches it off.
+  void set_min_refresh_hz(int hz) {
+    __atomic_store_n(&min_refresh_hz_, hz, __ATOMIC_RELAXED);
+  }
+  int min_refresh_hz() const {
+    return __atomic_load_n(&min_refresh_hz_, __ATOMIC_RELAXED);
+  }
+  // Most significant planes currently shown.
+  int shown_pwm_bits() const {
+    return std::min(__atomic_load_n(&shown_pwm_bits_, __ATOMIC_RELAXED),
+                    (int) shown_frame()->frame_->pwmbits());
+  }
+
+  // Hand over "other" to be shown starting with the next refresh. Returns
+  // the frame displayed so far once the refresh thread let go of it.
+  FrameCanvas *SwapOnVSync(FrameCanvas *other) {
+    MutexLock l(&frame_sync_);
+    FrameCanvas *previous = current_frame_;
+    if (!refreshing()) {
+      // Not refreshing yet: nothing to synchronize with.
+      __atomic_store_n(&current_frame_, other, __ATOMIC_RELEASE);
+      return previous;
+    }
+    __atomic_store_n(&next_frame_, other, __ATOMIC_RELEASE);
+    while (next_frame_ != NULL) {
+      frame_sync_.WaitOn(&frame_done_);
+    }
+    return previous;
+  }
+
+  // Triple buffering: "frame" becomes the newest published frame; returns
+  // the one published before it, which was either never shown or already
+  // given back by the refresh thread. Never waits. NULL the first time.
+  FrameCanvas *PublishFrame(FrameCanvas *frame) {
+    const uintptr_t previous =
+      __atomic_exchange_n(&published_, ((uintptr_t) frame) | kFresh,
+                          __ATOMIC_ACQ_REL);
+    return (FrameCanvas*) (previous & ~kFresh);
+  }
+
+  // Refreshes completed so far.
+  uint64_t refresh_count() const {
+    return __atomic_load_n(&refresh_count_, __ATOMIC_SEQ_CST);
+  }
+
+  // Block until "count" more refreshes are completed.
+  uint64_t WaitForRefreshes(int count) {
+    if (!refreshing()) return refresh_count();
+    MutexLock l(&refresh_mutex_);
+    // Registered before looking at the count: the refresh thread only
+    // takes the mutex to wake us up if it sees a waiter.
+    __atomic_add_fetch(&refresh_waiters_, 1, __ATOMIC_SEQ_CST);
+    const uint64_t target = refresh_count() + std::max(count, 0);
+    while (refresh_count() < target) {
+      refresh_mutex_.WaitOn(&refresh_done_);
+    }
+    __atomic_sub_fetch(&refresh_waiters_, 1, __ATOMIC_SEQ_CST);
+    return refresh_count();
+  }
+
+  // Created on first use; from then on the refresh thread signals it.
+  int event_fd() {
+    MutexLock l(&refresh_mutex_);
+    if (event_fd_ < 0) {
+      __atomic_store_n(&event_fd_, eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC),
+                       __ATOMIC_RELEASE);
+    }
+    return event_fd_;
+  }
+
+  // The frame currently shown. Only meaningful once the thread is stopped
+  // or from within the refresh thread.
+  FrameCanvas *current_frame() { return current_frame_; }
+  // Same, from any thread; by the time it is used, it might not be shown
+  // anymore.
+  const FrameCanvas *shown_frame() const {
+    return __atomic_load_n(&current_frame_, __ATOMIC_ACQUIRE);
+  }
+  // Whether "frame" is shown or handed over to be shown.
+  bool InUse(const FrameCanvas *frame) const {
+    const uintptr_t published = __atomic_load_n(&published_, __ATOMIC_ACQUIRE);
+    return frame == shown_frame()
+      || frame == __atomic_load_n(&next_frame_, __ATOMIC_ACQUIRE)
+      || frame == (const FrameCanvas*) (published & ~kFresh);
+  }
+
+  // The refresh thread starts over with its next refresh; until then,
+  // GetStats() reports nothing collected yet.
+  void ResetStats() {
+    __atomic_add_fetch(&reset_generation_, 1, __ATOMIC_SEQ_CST);
+  }
+
+  void set_deadline(int64_t nanos) {
+    __atomic_store_n(&deadline_, nanos, __ATOMIC_RELAXED);
+  }
+  int64_t deadline() const {
+    return __atomic_load_n(&deadline_, __ATOMIC_RELAXED);
+  }
+
+  void GetStats(RefreshStats *stats) const {
+    Counters counters;
+    ReadCounters(&counters);
+    if (counters.generation
+        != __atomic_load_n(&reset_generation_, __ATOMIC_SEQ_CST)) {
+      counters = Counters();   // Reset not picked up yet.
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->frames = counters.frames;
+    stats->deadline = deadline();
+    stats->pwm_bits = shown_pwm_bits();
+    stats->dither_phases = shown_frame()->frame_->dither_phases();
+    stats->missed_deadlines = counters.missed_deadlines;
+    const uint64_t periods = (counters.frames > 1) ? counters.frames - 1 : 0;
+    if (periods > 0) {
+      stats->min_period = counters.min_period;
+      stats->max_period = counters.max_period;
+      stats->avg_period = counters.period_sum / periods;
+      stats->p50_period = Percentile(counters, periods, 50);
+      stats->p90_period = Percentile(counters, periods, 90);
+      stats->p99_period = Percentile(counters, periods, 99);
+      stats->duty_cycle = 1.0 * counters.lit_sum / counters.period_sum;
+    }
+    const Framebuffer::PlaneTiming &timing = counters.plane_timing;
+    for (int p = 0; p < RefreshStats::kMaxPlanes; ++p) {
+      if (timing.count[p] == 0) continue;
+      stats->avg_plane_overshoot[p] = timing.overshoot_sum[p] / timing.count[p];
+      stats->max_plane_overshoot[p] = timing.overshoot_max[p];
+    }
   }
 
   virtual void Run() {
     while (running()) {
-#if SHOW_REFRESH_RATE
-      struct timeval start, end;
-      gettimeofday(&start, NULL);
-#endif
-      matrix_->UpdateScreen();
-#if SHOW_REFRESH_RATE
-      gettimeofday(&end, NULL);
-      int64_t usec = ((uint64_t)end.tv_sec * 1000000 + end.tv_usec)
-        - ((int64_t)start.tv_sec * 1000000 + start.tv_usec);
-      printf("\b\b\b\b\b\b\b\b%6.1fHz", 1e6 / usec);
-#endif
+      const int64_t start = GetNanos();
+      if (previous_start_ > 0 && display_ == NULL) {
+        AdaptPWMBits(start - previous_start_,
+                     current_frame_->framebuffer()->pwmbits());
+      }
+      previous_start_ = start;
+
+      Framebuffer::OutputOptions options;
+      options.pipelined = pipelined();
+      options.brightness = brightness();
+      options.pwm_bits = __atomic_load_n(&shown_pwm_bits_, __ATOMIC_RELAXED);
+      options.refresh = refreshes_++;
+      Framebuffer::PlaneTiming timing;
+      if (io_ != NULL) {
+        current_frame_->framebuffer()->DumpToMatrix(io_, options, &timing);
+      } else if (simulator_ != NULL) {
+        current_frame_->framebuffer()->DumpToMatrix(simulator_, options,
+                                                    &timing);
+      } else {
+        current_frame_->framebuffer()->EmulateRefresh(&lit_[0], options);
+        display_->ShowFrame(&lit_[0]);
+      }
+
+      // Frame boundary: this is the only place a swap becomes visible.
+      // Only takes a lock if SwapOnVSync() waits for us.
+      if (__atomic_load_n(&published_, __ATOMIC_ACQUIRE) & kFresh) {
+        // Only we clear kFresh, so there is a fresh one to take, maybe
+        // even newer by now. Ours goes back to the producer.
+        const uintptr_t newest =
+          __atomic_exchange_n(&published_, (uintptr_t) current_frame_,
+                              __ATOMIC_ACQ_REL);
+        __atomic_store_n(&current_frame_, (FrameCanvas*) (newest & ~kFresh),
+                         __ATOMIC_RELEASE);
+      }
+      if (__atomic_load_n(&next_frame_, __ATOMIC_ACQUIRE) != NULL) {
+        MutexLock l(&frame_sync_);
+        __atomic_store_n(&current_frame_, next_frame_, __ATOMIC_RELEASE);
+        next_frame_ = NULL;
+        pthread_cond_signal(&frame_done_);
+      }
+      RecordRefresh(start, timing);
+      NotifyRefresh();
     }
   }
 
 private:
+  // Periods in the histogram are in buckets of this size; the last bucket
+  // takes everything longer.
+  static const int64_t kHistogramResolution = 100000;
+  enum { kHistogramBuckets = 512 };
+
+  // Refresh statistics since the last reset.
+  struct Counters {
+    Counters()
+      : generation(0), frames(0), min_period(0), max_period(0),
+        period_sum(0), lit_sum(0), missed_deadlines(0) {
+      memset(histogram, 0, sizeof(histogram));
+    }
+    uint64_t generation;   // The ResetStats() these are counted since.
+    uint64_t frames;
+    int64_t min_period, max_period;
+    int64_t period_sum, lit_sum;
+    uint64_t missed_deadlines;
+    uint32_t histogram[kHistogramBuckets];
+    Framebuffer::PlaneTiming plane_timing;
+  };
+
+  // Refreshes averaged before the PWM depth is reconsidered.
+  enum { kAdaptWindow = 16 };
+  // How long a measured period for a depth is trusted; CPU frequency
+  // and load change.
+  static const int64_t kAdaptMemory = 10000000000LL;
+
   inline bool running() {
-    MutexLock l(&mutex_);
-    return running_;
+    return __atomic_load_n(&running_, __ATOMIC_ACQUIRE);
+  }
+  // Set before the thread starts, so no need to be atomic.
+  bool refreshing() const {
+    return io_ != NULL || simulator_ != NULL || display_ != NULL;
+  }
+
+  // Called from the refresh loop with every period. Drops the least
+  // significant plane if we're too slow. Adds it back once we expect to
+  // stay clear of the minimum rate with it: either because we measured
+  // that depth recently, or, if not, with a conservative guess. The 10%
+  // margin plus the memory of measured depths keeps us from oscillating.
+  void AdaptPWMBits(int64_t period, int available_bits) {
+    const int min_hz = min_refresh_hz();
+    if (min_hz <= 0) {
+      __atomic_store_n(&shown_pwm_bits_, (int) RefreshStats::kMaxPlanes,
+                       __ATOMIC_RELAXED);
+      window_sum_ = window_count_ = 0;
+      return;
+    }
+    window_sum_ += period;
+    if (++window_count_ < kAdaptWindow)
+      return;
+    const int64_t average = window_sum_ / window_count_;
+    window_sum_ = window_count_ = 0;
+
+    int bits = std::min(__atomic_load_n(&shown_pwm_bits_, __ATOMIC_RELAXED),
+                        available_bits);
+    const int64_t max_period = 1000000000LL / min_hz;
+    const int64_t now = GetNanos();
+    measured_period_[bits] = average;
+    measured_at_[bits] = now;
+    if (average > max_period) {
+      if (bits > 1) --bits;
+    } else if (bits < available_bits) {
+      int64_t expected = average * (bits + 1) / bits;
+      if (measured_at_[bits + 1] > now - kAdaptMemory)
+        expected = measured_period_[bits + 1];
+      if (expected < max_period * 9 / 10)
+        ++bits;
+    }
+    __atomic_store_n(&shown_pwm_bits_, bits, __ATOMIC_RELAXED);
+  }
+
+  // Count the refresh, wake up whoever waits for it. Nothing but an
+  // atomic increment unless someone is interested.
+  void NotifyRefresh() {
+    __atomic_add_fetch(&refresh_count_, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&refresh_waiters_, __ATOMIC_SEQ_CST) > 0) {
+      MutexLock l(&refresh_mutex_);
+      pthread_cond_broadcast(&refresh_done_);
+    }
+    const int fd = __atomic_load_n(&event_fd_, __ATOMIC_ACQUIRE);
+    if (fd >= 0) {
+      const uint64_t one = 1;
+      if (write(fd, &one, sizeof(one)) < 0) {
+        // Counter saturated because nobody reads; fine.
+      }
+    }
+  }
+
+  // Period is from the start of the previous refresh to "start"; so the
+  // lit time of the previous refresh goes with it. Never waits for readers:
+  // the sequence count is odd while the counters are updated, which tells
+  // ReadCounters() to try again.
+  void RecordRefresh(int64_t start, const Framebuffer::PlaneTiming &timing) {
+    __atomic_store_n(&stats_sequence_, stats_sequence_ + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    Counters *const c = &counters_;
+    const uint64_t generation =
+      __atomic_load_n(&reset_generation_, __ATOMIC_SEQ_CST);
+    if (c->generation != generation) {
+      *c = Counters();
+      c->generation = generation;
+    }
+    if (c->frames > 0 && last_start_ > 0) {
+      const int64_t period = start - last_start_;
+      if (c->frames == 1 || period < c->min_period) c->min_period = period;
+      if (period > c->max_period) c->max_period = period;
+      c->period_sum += period;
+      c->lit_sum += last_lit_;
+      int bucket = period / kHistogramResolution;
+      if (bucket >= kHistogramBuckets) bucket = kHistogramBuckets - 1;
+      c->histogram[bucket]++;
+      const int64_t limit = deadline();
+      if (limit > 0 && period > limit) c->missed_deadlines++;
+    }
+    for (int p = 0; p < RefreshStats::kMaxPlanes; ++p) {
+      c->plane_timing.overshoot_sum[p] += timing.overshoot_sum[p];
+      if (timing.overshoot_max[p] > c->plane_timing.overshoot_max[p])
+        c->plane_timing.overshoot_max[p] = timing.overshoot_max[p];
+      c->plane_timing.count[p] += timing.count[p];
+    }
+    c->frames++;
+    last_start_ = start;
+    last_lit_ = timing.lit_nanos;
+    __atomic_store_n(&stats_sequence_, stats_sequence_ + 1, __ATOMIC_RELEASE);
+  }
+
+  // A consistent copy of the counters, taken while the refresh thread is
+  // not updating them.
+  void ReadCounters(Counters *copy) const {
+    for (;;) {
+      const uint32_t before =
+        __atomic_load_n(&stats_sequence_, __ATOMIC_ACQUIRE);
+      if (before & 1) {
+        sched_yield();   // Let a preempted refresh thread finish.
+        continue;
+      }
+      *copy = counters_;
+      __atomic_thread_fence(__ATOMIC_ACQUIRE);
+      if (__atomic_load_n(&stats_sequence_, __ATOMIC_RELAXED) == before)
+        return;
+    }
+  }
+
+  // Upper bound of the histogram bucket the given percentile falls in.
+  static int64_t Percentile(const Counters &counters, uint64_t periods,
+                            int percent) {
+    const uint64_t wanted = (periods * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistogramBuckets - 1; ++i) {
+      seen += counters.histogram[i];
+      if (seen >= wanted) {
+        return std::min(counters.max_period, (i + 1) * kHistogramResolution);
+      }
+    }
+    return counters.max_period;
   }
 
-  Mutex mutex_;
   bool running_;
-  RGBMatrix *const matrix_;
+  GPIO *io_;
+  GPIOSimulator *simulator_;
+  VirtualDisplay *display_;
+  std::vector<uint16_t> lit_;   // Emulated refresh for display_.
+  bool pipelined_;
+  int brightness_;
+
+  int min_refresh_hz_;
+  int shown_pwm_bits_;
+  // Only used by the refresh thread.
+  int64_t previous_start_;
+  int64_t window_sum_;
+  int window_count_;
+  int64_t measured_period_[RefreshStats::kMaxPlanes + 1];   // Per depth.
+  int64_t measured_at_[RefreshStats::kMaxPlanes + 1];
+  uint32_t refreshes_;
+
+  Mutex refresh_mutex_;
+  pthread_cond_t refresh_done_;
+  uint64_t refresh_count_;
+  int refresh_waiters_;
+  int event_fd_;
+
+  Mutex frame_sync_;
+  pthread_cond_t frame_done_;
+  FrameCanvas *current_frame_;
+  FrameCanvas *next_frame_;
+
+  // The triple buffer handoff: the last published frame, with kFresh set
+  // until the refresh thread took it. On a cache line of its own, as
+  // producer and refresh thread both write it.
+  static const uintptr_t kFresh = 1;
+  char published_padding_before_[64];
+  uintptr_t published_;
+  char published_padding_after_[64];
+
+  // Refresh statistics: only written by the refresh thread, read through
+  // the sequence count (a seqlock), so monitoring never holds it up.
+  uint32_t stats_sequence_;   // Odd while counters_ is being updated.
+  Counters counters_;
+  int64_t last_start_;        // Only used by the refresh thread.
+  int64_t last_lit_;
+  uint64_t reset_generation_; // Counts ResetStats() calls.
+  int64_t deadline_;
 };
 
-RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays)
-  : frame_(new Framebuffer(rows, 32 * chained_displays)),
-    io_(NULL), updater_(NULL) {
+RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays,
+                     int parallel_displays)
+  : rows_(rows), chained_displays_(chained_displays),
+    parallel_displays_(std::max(1, std::min((int) Framebuffer::kMaxParallel,
+                                            parallel_displays))),
+    pwm_bits_(RefreshStats::kMaxPlanes), dither_bits_(0),
+    thread_name_("rgb-refresh"),
+    thread_options_set_(false),
+    active_(NULL), io_(NULL), simulator_(NULL), virtual_display_(NULL),
+    updater_(NULL),
+    recorder_(NULL) {
+  active_ = CreateFrameCanvas();
+  updater_ = new UpdateThread(active_);
+  thread_options_.policy = SCHED_FIFO;
+  thread_options_.priority = 99;
+  thread_options_.name = thread_name_.c_str();
   Clear();
   SetGPIO(io);
 }
@@ -82,41 +503,345 @@ RGBMatrix::RGBMatrix(GPIO *io, int rows, int chained_displays)
 RGBMatrix::~RGBMatrix() {
   updater_->Stop();
   updater_->WaitStopped();
+
+  // Leave the LEDs dark.
+  if (io_ != NULL) {
+    FrameCanvas *shown = updater_->current_frame();
+    shown->Clear();
+    shown->framebuffer()->DumpToMatrix(io_);
+  }
   delete updater_;
 
-  frame_->Clear();
-  frame_->DumpToMatrix(io_);
-  delete frame_;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    delete created_frames_[i];
+  }
 }
 
 void RGBMatrix::SetGPIO(GPIO *io) {
   if (io == NULL) return;  // nothing to set.
-  if (io_ != NULL) return;  // already set.
+  if (io_ != NULL || simulator_ != NULL || virtual_display_ != NULL)
+    return;  // already set.
   io_ = io;
-  Framebuffer::InitGPIO(io_);
-  updater_ = new UpdateThread(this);
-  updater_->Start(99);  // Whatever we get :)
+  Framebuffer::InitGPIO(io_, rows_, parallel_displays_);
+  updater_->Start(io_, NULL, NULL, thread_options_);
 }
 
-bool RGBMatrix::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
-uint8_t RGBMatrix::pwmbits() { return frame_->pwmbits(); }
+void RGBMatrix::SetSimulator(GPIOSimulator *simulator) {
+  if (simulator == NULL) return;
+  if (io_ != NULL || simulator_ != NULL || virtual_display_ != NULL)
+    return;  // already set.
+  simulator_ = simulator;
+  GPIOSimulator::Pins pins;
+  Framebuffer::DescribePins(&pins, rows_, parallel_displays_);
+  simulator_->Configure(pins, rows_ / 2, 32 * chained_displays_);
+  updater_->Start(NULL, simulator_, NULL, NonRealtimeOptions());
+}
+
+void RGBMatrix::SetVirtualDisplay(VirtualDisplay *display) {
+  if (display == NULL) return;
+  if (io_ != NULL || simulator_ != NULL || virtual_display_ != NULL)
+    return;  // already set.
+  virtual_display_ = display;
+  virtual_display_->Configure(width(), height());
+  updater_->Start(NULL, NULL, virtual_display_, NonRealtimeOptions());
+}
+
+// Not real hardware: no realtime, unless asked for explicitly.
+ThreadOptions RGBMatrix::NonRealtimeOptions() const {
+  ThreadOptions options = thread_options_;
+  if (!thread_options_set_) {
+    options.policy = SCHED_OTHER;
+    options.priority = 0;
+  }
+  return options;
+}
+
+bool RGBMatrix::SetRefreshThreadOptions(const ThreadOptions &options) {
+  if (io_ != NULL || simulator_ != NULL || virtual_display_ != NULL)
+    return false;  // Already running.
+  thread_options_ = options;
+  thread_name_ = options.name ? options.name : "";
+  thread_options_.name = options.name ? thread_name_.c_str() : NULL;
+  thread_options_set_ = true;
+  return true;
+}
+
+const ThreadStatus &RGBMatrix::refresh_thread_status() const {
+  return updater_->status();
+}
+
+uint64_t RGBMatrix::refresh_count() const {
+  return updater_->refresh_count();
+}
+
+uint64_t RGBMatrix::WaitForRefreshes(int count) {
+  return updater_->WaitForRefreshes(count);
+}
+
+int RGBMatrix::refresh_event_fd() {
+  return updater_->event_fd();
+}
+
+FrameCanvas *RGBMatrix::CreateFrameCanvas() {
+  return CreateCanvas(0, 0);
+}
+
+FrameCanvas *RGBMatrix::CreateScrollCanvas(int virtual_width,
+                                           int virtual_height) {
+  if (virtual_width < width() || virtual_height < height()
+      || virtual_width > 65535 || virtual_height > 65535
+      || (int64_t) virtual_width * virtual_height
+         > Framebuffer::kMaxVirtualPixels)
+    return NULL;
+  return CreateCanvas(virtual_width, virtual_height);
+}
+
+bool RGBMatrix::DeleteFrameCanvas(FrameCanvas *canvas) {
+  if (canvas == active_ || updater_->InUse(canvas))
+    return false;
+  std::vector<FrameCanvas*>::iterator found =
+    std::find(created_frames_.begin(), created_frames_.end(), canvas);
+  if (found == created_frames_.end())
+    return false;
+  created_frames_.erase(found);
+  delete canvas;
+  return true;
+}
+
+FrameCanvas *RGBMatrix::CreateCanvas(int virtual_width, int virtual_height) {
+  FrameCanvas *result =
+    new FrameCanvas(new Framebuffer(rows_, 32 * chained_displays_,
+                                    parallel_displays_,
+                                    virtual_width, virtual_height,
+                                    pwm_bits_, curve_, dither_bits_));
+  created_frames_.push_back(result);
+  return result;
+}
+
+FrameCanvas *RGBMatrix::SwapOnVSync(FrameCanvas *other) {
+  other->framebuffer()->MarkClean();
+  FrameCanvas *previous = updater_->SwapOnVSync(other);
+  Record(other);
+  return previous;
+}
+
+FrameCanvas *RGBMatrix::PublishFrame(FrameCanvas *frame) {
+  frame->framebuffer()->MarkClean();
+  FrameCanvas *result = updater_->PublishFrame(frame);
+  Record(frame);   // Only read by the refresh thread from now on.
+  // The third buffer, created when first needed.
+  return result != NULL
+    ? result : CreateCanvas(frame->width(), frame->height());
+}
+
+bool RGBMatrix::SetPWMBits(uint8_t value) {
+  if (!active_->SetPWMBits(value))
+    return false;
+  pwm_bits_ = value;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    if (created_frames_[i] == active_) continue;   // Done above.
+    created_frames_[i]->SetPWMBits(value);
+  }
+  return true;
+}
+uint8_t RGBMatrix::pwmbits() { return pwm_bits_; }
 
 // Map brightness of output linearly to input with CIE1931 profile.
 void RGBMatrix::set_luminance_correct(bool on) {
-  frame_->set_luminance_correct(on);
+  curve_.type = on ? ResponseCurve::kCIE1931 : ResponseCurve::kLinear;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    created_frames_[i]->set_luminance_correct(on);
+  }
 }
-bool RGBMatrix::luminance_correct() const { return frame_->luminance_correct(); }
-void RGBMatrix::UpdateScreen() { frame_->DumpToMatrix(io_); }
+bool RGBMatrix::luminance_correct() const {
+  return curve_.type == ResponseCurve::kCIE1931;
+}
+
+bool RGBMatrix::SetResponseCurve(const ResponseCurve &curve) {
+  if (!active_->SetResponseCurve(curve))
+    return false;
+  curve_ = curve;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    if (created_frames_[i] == active_) continue;   // Done above.
+    created_frames_[i]->SetResponseCurve(curve);
+  }
+  return true;
+}
+const ResponseCurve &RGBMatrix::response_curve() const { return curve_; }
+
+bool RGBMatrix::SetDitherBits(uint8_t bits) {
+  if (!active_->SetDitherBits(bits))
+    return false;
+  dither_bits_ = bits;
+  for (size_t i = 0; i < created_frames_.size(); ++i) {
+    if (created_frames_[i] == active_) continue;   // Done above.
+    created_frames_[i]->SetDitherBits(bits);
+  }
+  return true;
+}
+uint8_t RGBMatrix::ditherbits() const { return dither_bits_; }
 
-// -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
-int RGBMatrix::width() const { return frame_->width(); }
-int RGBMatrix::height() const { return frame_->height(); }
+void RGBMatrix::GetRefreshStats(RefreshStats *stats) const {
+  updater_->GetStats(stats);
+}
+void RGBMatrix::ResetRefreshStats() { updater_->ResetStats(); }
+void RGBMatrix::set_refresh_deadline_usec(int usec) {
+  updater_->set_deadline(usec * 1000LL);
+}
+int RGBMatrix::refresh_deadline_usec() const {
+  return updater_->deadline() / 1000;
+}
+
+bool RGBMatrix::SetBrightness(uint8_t brightness) {
+  if (brightness > 100)
+    return false;
+  updater_->set_brightness(brightness);
+  return true;
+}
+uint8_t RGBMatrix::brightness() const { return updater_->brightness(); }
+
+void RGBMatrix::set_min_refresh_rate(int hz) {
+  updater_->set_min_refresh_hz(hz);
+}
+int RGBMatrix::min_refresh_rate() const { return updater_->min_refresh_hz(); }
+int RGBMatrix::shown_pwm_bits() const { return updater_->shown_pwm_bits(); }
+
+void RGBMatrix::set_pipelined_output(bool on) { updater_->set_pipelined(on); }
+bool RGBMatrix::pipelined_output() const { return updater_->pipelined(); }
+
+// -- Implementation of RGBMatrix Canvas: delegation to the active FrameCanvas
+int RGBMatrix::width() const { return active_->width(); }
+int RGBMatrix::height() const { return active_->height(); }
 void RGBMatrix::SetPixel(int x, int y,
                          uint8_t red, uint8_t green, uint8_t blue) {
-  frame_->SetPixel(x, y, red, green, blue);
+  active_->SetPixel(x, y, red, green, blue);
 }
-void RGBMatrix::Clear() { return frame_->Clear(); }
+void RGBMatrix::Clear() { return active_->Clear(); }
 void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
+  active_->Fill(red, green, blue);
+}
+void RGBMatrix::FillRect(int x, int y, int width, int height,
+                         uint8_t red, uint8_t green, uint8_t blue) {
+  active_->FillRect(x, y, width, height, red, green, blue);
+}
+void RGBMatrix::DrawHSpan(int x, int y, int count, const uint8_t *rgb) {
+  active_->DrawHSpan(x, y, count, rgb);
+}
+void RGBMatrix::Blit(int x, int y, int width, int height,
+                     const uint8_t *rgb, int stride,
+                     const uint8_t *color_key) {
+  active_->Blit(x, y, width, height, rgb, stride, color_key);
+}
+void RGBMatrix::SetPixels(int x, int y, int width, int height,
+                          const uint8_t *data, int stride,
+                          PixelFormat format) {
+  active_->SetPixels(x, y, width, height, data, stride, format);
+}
+bool RGBMatrix::GetPixel(int x, int y,
+                         uint8_t *red, uint8_t *green, uint8_t *blue) const {
+  return active_->GetPixel(x, y, red, green, blue);
+}
+void RGBMatrix::GetPixels(int x, int y, int width, int height,
+                          uint8_t *data, int stride,
+                          PixelFormat format) const {
+  active_->GetPixels(x, y, width, height, data, stride, format);
+}
+void RGBMatrix::Screenshot(uint8_t *data, int stride,
+                           PixelFormat format) const {
+  updater_->shown_frame()->frame_->GetShownPixels(data, stride,
+                                                  format == kRGBX32 ? 4 : 3);
+}
+
+bool RGBMatrix::SetRecorder(StreamRecorder *recorder) {
+  if (recorder != NULL
+      && (recorder->width() != width() || recorder->height() != height())) {
+    return false;
+  }
+  recorder_ = recorder;
+  return true;
+}
+
+bool RGBMatrix::RecordFrame() { return Record(updater_->shown_frame()); }
+
+bool RGBMatrix::Record(const FrameCanvas *frame) {
+  if (recorder_ == NULL)
+    return false;
+  uint8_t *buffer = recorder_->AcquireFrame();
+  if (buffer == NULL)
+    return false;
+  frame->frame_->GetShownPixels(buffer, 3 * width(), 3);
+  recorder_->CommitFrame(buffer);
+  return true;
+}
+
+// -- FrameCanvas: thin wrapper around the Framebuffer
+FrameCanvas::~FrameCanvas() { delete frame_; }
+bool FrameCanvas::SetPWMBits(uint8_t value) {
+  return frame_->SetPWMBits(value);
+}
+uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
+void FrameCanvas::set_luminance_correct(bool on) {
+  frame_->set_luminance_correct(on);
+}
+bool FrameCanvas::luminance_correct() const {
+  return frame_->luminance_correct();
+}
+bool FrameCanvas::SetResponseCurve(const ResponseCurve &curve) {
+  return frame_->SetResponseCurve(curve);
+}
+const ResponseCurve &FrameCanvas::response_curve() const {
+  return frame_->response_curve();
+}
+bool FrameCanvas::SetDitherBits(uint8_t bits) {
+  return frame_->SetDitherBits(bits);
+}
+uint8_t FrameCanvas::ditherbits() const { return frame_->ditherbits(); }
+int FrameCanvas::width() const { return frame_->width(); }
+int FrameCanvas::height() const { return frame_->height(); }
+void FrameCanvas::SetPixel(int x, int y,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->SetPixel(x, y, red, green, blue);
+}
+void FrameCanvas::Clear() { return frame_->Clear(); }
+void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
 }
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void FrameCanvas::DrawHSpan(int x, int y, int count, const uint8_t *rgb) {
+  frame_->SetPixels(x, y, count, 1, rgb, 3 * count, 3);
+}
+void FrameCanvas::Blit(int x, int y, int width, int height,
+                       const uint8_t *rgb, int stride,
+                       const uint8_t *color_key) {
+  frame_->Blit(x, y, width, height, rgb, stride, color_key);
+}
+void FrameCanvas::SetPixels(int x, int y, int width, int height,
+                            const uint8_t *data, int stride,
+                            PixelFormat format) {
+  frame_->SetPixels(x, y, width, height, data, stride,
+                    format == kRGBX32 ? 4 : 3);
+}
+bool FrameCanvas::GetPixel(int x, int y, uint8_t *red, uint8_t *green,
+                           uint8_t *blue) const {
+  return frame_->GetPixel(x, y, red, green, blue);
+}
+void FrameCanvas::GetPixels(int x, int y, int width, int height,
+                            uint8_t *data, int stride,
+                            PixelFormat format) const {
+  frame_->GetPixels(x, y, width, height, data, stride,
+                    format == kRGBX32 ? 4 : 3);
+}
+void FrameCanvas::SetScrollOffset(int x, int y) {
+  frame_->SetScrollOffset(x, y);
+}
+int FrameCanvas::scroll_x() const { return frame_->scroll_x(); }
+int FrameCanvas::scroll_y() const { return frame_->scroll_y(); }
+int FrameCanvas::modified_double_rows() const {
+  return frame_->DirtyDoubleRows();
+}
+uint64_t FrameCanvas::encoded_rows() const { return frame_->encoded_rows(); }
+uint64_t FrameCanvas::skipped_rows() const { return frame_->skipped_rows(); }
 }  // end namespace rgb_matrix
@@ -0,0 +1,60 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_RGBMATRIX_PLANE_ENCODER_INTERNAL_H
+#define RPI_RGBMATRIX_PLANE_ENCODER_INTERNAL_H
+
+#include <stdint.h>
+
+namespace rgb_matrix {
+// The bits of a bitplane entry that represent red, green and blue of one
+// sub-panel half.
+struct PlaneBitMasks {
+  uint8_t red;
+  uint8_t green;
+  uint8_t blue;
+};
+
+// Transposes "count" pixels, whose colors are already mapped to the output
+// range, into bitplane entries: for each plane b in [first_plane,
+// last_plane), entry out[(b - first_plane) * plane_stride + i] gets the
+// red/green/blue mask set if bit b of the respective color of pixel i is
+// set, cleared otherwise. All other bits in the entry are left untouched.
+typedef void (*PlaneEncodeFun)(const uint16_t *red, const uint16_t *green,
+                               const uint16_t *blue, int count,
+                               const PlaneBitMasks &masks,
+                               int first_plane, int last_plane,
+                               uint8_t *out, int plane_stride);
+
+struct PlaneEncoder {
+  const char *name;
+  PlaneEncodeFun encode;
+};
+
+// The plain C++ version everything else is measured against.
+extern const PlaneEncoder kScalarPlaneEncoder;
+
+// Returns the encoders the CPU we're running on supports, fastest first,
+// terminated by an entry with name NULL. The scalar one is always last.
+const PlaneEncoder *AvailablePlaneEncoders();
+
+// Returns true if "encoder" gives bit-exactly the same result as the
+// scalar version on a test pattern.
+bool VerifyPlaneEncoder(const PlaneEncoder &encoder);
+
+// The fastest available encoder that passes VerifyPlaneEncoder(). Selected
+// once on first use.
+const PlaneEncoder &GetPlaneEncoder();
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_PLANE_ENCODER_INTERNAL_H
@@ -0,0 +1,291 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Encoding of color values into bitplanes is essentially a bit-transpose,
+// which lends itself to SIMD: for a bunch of pixels at once, we test bit b
+// of each color and turn the result into the respective output bits.
+//
+// The vector versions are only compiled if the compiler can generate code
+// for them and only used if the CPU we run on supports them.
+
+#include "plane-encoder-internal.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#  define RGBMATRIX_X86_ENCODERS 1
+#  include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  define RGBMATRIX_NEON_ENCODER 1
+#  include <arm_neon.h>
+#  if !defined(__aarch64__)
+#    include <sys/auxv.h>
+#    include <asm/hwcap.h>
+#  endif
+#endif
+
+namespace rgb_matrix {
+
+static void EncodeScalar(const uint16_t *red, const uint16_t *green,
+                         const uint16_t *blue, int count,
+                         const PlaneBitMasks &masks,
+                         int first_plane, int last_plane,
+                         uint8_t *out, int plane_stride) {
+  const uint8_t keep = ~(masks.red | masks.green | masks.blue);
+  for (int b = first_plane; b < last_plane; ++b, out += plane_stride) {
+    for (int i = 0; i < count; ++i) {
+      out[i] = (out[i] & keep)
+        | (-((red[i] >> b) & 1) & masks.red)
+        | (-((green[i] >> b) & 1) & masks.green)
+        | (-((blue[i] >> b) & 1) & masks.blue);
+    }
+  }
+}
+
+// The vector versions do the bulk of the pixels and leave the remainder
+// that doesn't fill a whole vector to the scalar version.
+static inline void EncodeTail(const uint16_t *red, const uint16_t *green,
+                              const uint16_t *blue, int done, int count,
+                              const PlaneBitMasks &masks,
+                              int first_plane, int last_plane,
+                              uint8_t *out, int plane_stride) {
+  if (done < count) {
+    EncodeScalar(red + done, green + done, blue + done, count - done,
+                 masks, first_plane, last_plane, out + done, plane_stride);
+  }
+}
+
+#ifdef RGBMATRIX_X86_ENCODERS
+// 16 pixels per step. The comparison yields 0xffff for each 16 bit lane
+// that has the bit set; packing with signed saturation narrows that to
+// 0xff per byte.
+__attribute__((target("sse2")))
+static void EncodeSSE2(const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue, int count,
+                       const PlaneBitMasks &masks,
+                       int first_plane, int last_plane,
+                       uint8_t *out, int plane_stride) {
+  const __m128i red_mask = _mm_set1_epi8(masks.red);
+  const __m128i green_mask = _mm_set1_epi8(masks.green);
+  const __m128i blue_mask = _mm_set1_epi8(masks.blue);
+  const __m128i keep = _mm_set1_epi8(~(masks.red | masks.green | masks.blue));
+  int i = 0;
+  for (/**/; i + 16 <= count; i += 16) {
+    const __m128i r0 = _mm_loadu_si128((const __m128i*)(red + i));
+    const __m128i r1 = _mm_loadu_si128((const __m128i*)(red + i + 8));
+    const __m128i g0 = _mm_loadu_si128((const __m128i*)(green + i));
+    const __m128i g1 = _mm_loadu_si128((const __m128i*)(green + i + 8));
+    const __m128i b0 = _mm_loadu_si128((const __m128i*)(blue + i));
+    const __m128i b1 = _mm_loadu_si128((const __m128i*)(blue + i + 8));
+    uint8_t *plane_out = out + i;
+    for (int p = first_plane; p < last_plane; ++p, plane_out += plane_stride) {
+      const __m128i bit = _mm_set1_epi16(1 << p);
+      const __m128i r_set = _mm_packs_epi16(
+        _mm_cmpeq_epi16(_mm_and_si128(r0, bit), bit),
+        _mm_cmpeq_epi16(_mm_and_si128(r1, bit), bit));
+      const __m128i g_set = _mm_packs_epi16(
+        _mm_cmpeq_epi16(_mm_and_si128(g0, bit), bit),
+        _mm_cmpeq_epi16(_mm_and_si128(g1, bit), bit));
+      const __m128i b_set = _mm_packs_epi16(
+        _mm_cmpeq_epi16(_mm_and_si128(b0, bit), bit),
+        _mm_cmpeq_epi16(_mm_and_si128(b1, bit), bit));
+      const __m128i bits = _mm_or_si128(
+        _mm_or_si128(_mm_and_si128(r_set, red_mask),
+                     _mm_and_si128(g_set, green_mask)),
+        _mm_and_si128(b_set, blue_mask));
+      __m128i *dest = (__m128i*)plane_out;
+      _mm_storeu_si128(dest, _mm_or_si128(
+                         _mm_and_si128(_mm_loadu_si128(dest), keep), bits));
+    }
+  }
+  EncodeTail(red, green, blue, i, count, masks, first_plane, last_plane,
+             out, plane_stride);
+}
+
+// 32 pixels per step. Same as SSE2, but the AVX2 pack works within 128 bit
+// lanes, so the 64 bit quarters of the result come out as 0, 2, 1, 3 and
+// are put back in order with a permute.
+__attribute__((target("avx2")))
+static void EncodeAVX2(const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue, int count,
+                       const PlaneBitMasks &masks,
+                       int first_plane, int last_plane,
+                       uint8_t *out, int plane_stride) {
+  const __m256i red_mask = _mm256_set1_epi8(masks.red);
+  const __m256i green_mask = _mm256_set1_epi8(masks.green);
+  const __m256i blue_mask = _mm256_set1_epi8(masks.blue);
+  const __m256i keep =
+    _mm256_set1_epi8(~(masks.red | masks.green | masks.blue));
+  int i = 0;
+  for (/**/; i + 32 <= count; i += 32) {
+    const __m256i r0 = _mm256_loadu_si256((const __m256i*)(red + i));
+    const __m256i r1 = _mm256_loadu_si256((const __m256i*)(red + i + 16));
+    const __m256i g0 = _mm256_loadu_si256((const __m256i*)(green + i));
+    const __m256i g1 = _mm256_loadu_si256((const __m256i*)(green + i + 16));
+    const __m256i b0 = _mm256_loadu_si256((const __m256i*)(blue + i));
+    const __m256i b1 = _mm256_loadu_si256((const __m256i*)(blue + i + 16));
+    uint8_t *plane_out = out + i;
+    for (int p = first_plane; p < last_plane; ++p, plane_out += plane_stride) {
+      const __m256i bit = _mm256_set1_epi16(1 << p);
+      const __m256i r_set = _mm256_packs_epi16(
+        _mm256_cmpeq_epi16(_mm256_and_si256(r0, bit), bit),
+        _mm256_cmpeq_epi16(_mm256_and_si256(r1, bit), bit));
+      const __m256i g_set = _mm256_packs_epi16(
+        _mm256_cmpeq_epi16(_mm256_and_si256(g0, bit), bit),
+        _mm256_cmpeq_epi16(_mm256_and_si256(g1, bit), bit));
+      const __m256i b_set = _mm256_packs_epi16(
+        _mm256_cmpeq_epi16(_mm256_and_si256(b0, bit), bit),
+        _mm256_cmpeq_epi16(_mm256_and_si256(b1, bit), bit));
+      const __m256i bits = _mm256_permute4x64_epi64(
+        _mm256_or_si256(_mm256_or_si256(_mm256_and_si256(r_set, red_mask),
+                                        _mm256_and_si256(g_set, green_mask)),
+                        _mm256_and_si256(b_set, blue_mask)),
+        _MM_SHUFFLE(3, 1, 2, 0));
+      __m256i *dest = (__m256i*)plane_out;
+      _mm256_storeu_si256(dest, _mm256_or_si256(
+                            _mm256_and_si256(_mm256_loadu_si256(dest), keep),
+                            bits));
+    }
+  }
+  EncodeTail(red, green, blue, i, count, masks, first_plane, last_plane,
+             out, plane_stride);
+}
+#endif  // RGBMATRIX_X86_ENCODERS
+
+#ifdef RGBMATRIX_NEON_ENCODER
+// 16 pixels per step. vtst gives us all-ones for lanes with the bit set;
+// narrowing makes that one byte per pixel.
+static void EncodeNEON(const uint16_t *red, const uint16_t *green,
+                       const uint16_t *blue, int count,
+                       const PlaneBitMasks &masks,
+                       int first_plane, int last_plane,
+                       uint8_t *out, int plane_stride) {
+  const uint8x16_t red_mask = vdupq_n_u8(masks.red);
+  const uint8x16_t green_mask = vdupq_n_u8(masks.green);
+  const uint8x16_t blue_mask = vdupq_n_u8(masks.blue);
+  const uint8x16_t color_mask = vdupq_n_u8(masks.red | masks.green
+                                           | masks.blue);
+  int i = 0;
+  for (/**/; i + 16 <= count; i += 16) {
+    const uint16x8_t r0 = vld1q_u16(red + i);
+    const uint16x8_t r1 = vld1q_u16(red + i + 8);
+    const uint16x8_t g0 = vld1q_u16(green + i);
+    const uint16x8_t g1 = vld1q_u16(green + i + 8);
+    const uint16x8_t b0 = vld1q_u16(blue + i);
+    const uint16x8_t b1 = vld1q_u16(blue + i + 8);
+    uint8_t *plane_out = out + i;
+    for (int p = first_plane; p < last_plane; ++p, plane_out += plane_stride) {
+      const uint16x8_t bit = vdupq_n_u16(1 << p);
+      const uint8x16_t r_set = vcombine_u8(vmovn_u16(vtstq_u16(r0, bit)),
+                                           vmovn_u16(vtstq_u16(r1, bit)));
+      const uint8x16_t g_set = vcombine_u8(vmovn_u16(vtstq_u16(g0, bit)),
+                                           vmovn_u16(vtstq_u16(g1, bit)));
+      const uint8x16_t b_set = vcombine_u8(vmovn_u16(vtstq_u16(b0, bit)),
+                                           vmovn_u16(vtstq_u16(b1, bit)));
+      const uint8x16_t bits = vorrq_u8(
+        vorrq_u8(vandq_u8(r_set, red_mask), vandq_u8(g_set, green_mask)),
+        vandq_u8(b_set, blue_mask));
+      vst1q_u8(plane_out, vbslq_u8(color_mask, bits, vld1q_u8(plane_out)));
+    }
+  }
+  EncodeTail(red, green, blue, i, count, masks, first_plane, last_plane,
+             out, plane_stride);
+}
+
+static bool HaveNEON() {
+#if defined(__aarch64__)
+  return true;
+#else
+  return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+#endif  // RGBMATRIX_NEON_ENCODER
+
+const PlaneEncoder kScalarPlaneEncoder = { "scalar", &EncodeScalar };
+
+static const PlaneEncoder *CreateAvailableEncoderList() {
+  static PlaneEncoder result[5];
+  int count = 0;
+#ifdef RGBMATRIX_X86_ENCODERS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    const PlaneEncoder avx2 = { "avx2", &EncodeAVX2 };
+    result[count++] = avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    const PlaneEncoder sse2 = { "sse2", &EncodeSSE2 };
+    result[count++] = sse2;
+  }
+#endif
+#ifdef RGBMATRIX_NEON_ENCODER
+  if (HaveNEON()) {
+    const PlaneEncoder neon = { "neon", &EncodeNEON };
+    result[count++] = neon;
+  }
+#endif
+  result[count++] = kScalarPlaneEncoder;
+  const PlaneEncoder terminator = { NULL, NULL };
+  result[count] = terminator;
+  return result;
+}
+
+const PlaneEncoder *AvailablePlaneEncoders() {
+  static const PlaneEncoder *const list = CreateAvailableEncoderList();
+  return list;
+}
+
+bool VerifyPlaneEncoder(const PlaneEncoder &encoder) {
+  // Odd count, so that the tail handling is exercised as well. The output
+  // is pre-filled with garbage to make sure unrelated bits survive.
+  enum { kCount = 61, kPlanes = 11 };
+  uint16_t red[kCount], green[kCount], blue[kCount];
+  uint8_t expected[kCount * kPlanes], actual[kCount * kPlanes];
+  uint32_t random = 0x2545f491;
+  for (int i = 0; i < kCount; ++i) {
+    random = random * 1103515245 + 12345; red[i] = random >> 16;
+    random = random * 1103515245 + 12345; green[i] = random >> 16;
+    random = random * 1103515245 + 12345; blue[i] = random >> 16;
+  }
+  for (int i = 0; i < kCount * kPlanes; ++i) {
+    random = random * 1103515245 + 12345;
+    expected[i] = actual[i] = random >> 16;
+  }
+  // Masks with bits spread over the whole entry.
+  const PlaneBitMasks masks = { (1 << 0) | (1 << 7), 1 << 3, 1 << 5 };
+  kScalarPlaneEncoder.encode(red, green, blue, kCount, masks, 0, kPlanes,
+                             expected, kCount);
+  encoder.encode(red, green, blue, kCount, masks, 0, kPlanes,
+                 actual, kCount);
+  return memcmp(expected, actual, sizeof(expected)) == 0;
+}
+
+static const PlaneEncoder *SelectPlaneEncoder() {
+  for (const PlaneEncoder *e = AvailablePlaneEncoders(); e->name; ++e) {
+    if (VerifyPlaneEncoder(*e))
+      return e;
+    fprintf(stderr, "%s plane encoder does not match scalar version. "
+            "Not using it.\n", e->name);
+  }
+  return &kScalarPlaneEncoder;
+}
+
+const PlaneEncoder &GetPlaneEncoder() {
+  static const PlaneEncoder *const selected = SelectPlaneEncoder();
+  return *selected;
+}
+}  // namespace rgb_matrix
@@ -0,0 +1,277 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Runs the refresh loop into the GPIOSimulator, measures refresh rate and
+// duty cycle, and verifies that the panels would show what we asked for,
+// also with dithering and for a scroll window wrapping around the display
+// edges.
+// Doesn't need GPIO access, so it can run on any Linux box. The timing is
+// only indicative of the real thing, as the simulator records timestamps.
+//
+//   make -C lib refresh-benchmark
+//   lib/refresh-benchmark [<chain> [<ms> [<parallel> [<rows>]]]]
+
+#include "led-matrix.h"
+#include "gpio-simulator.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <vector>
+
+using namespace rgb_matrix;
+
+// PWM depth we check at: with 8 bits and no luminance correction, plane
+// p simply shows bit p of the 8 bit color value.
+static const int kPwmBits = 8;
+
+// Dithering we check: the deepest there is, recovering four of the planes
+// left out.
+static const int kDitherPwmBits = 7;
+static const int kDitherBits = 4;
+
+static bool Run(bool pipelined, int rows, int chain, int parallel, int millis,
+                const uint8_t *image) {
+  const int width = 32 * chain;
+  const int height = rows * parallel;
+  GPIOSimulator simulator;
+  RGBMatrix *matrix = new RGBMatrix(NULL, rows, chain, parallel);
+  matrix->SetPWMBits(kPwmBits);
+  matrix->set_luminance_correct(false);
+  matrix->set_pipelined_output(pipelined);
+  matrix->SetPixels(0, 0, width, height, image, width * 3);
+  matrix->SetSimulator(&simulator);
+  usleep(millis * 1000);
+  RefreshStats stats;
+  matrix->GetRefreshStats(&stats);
+  delete matrix;  // Stops writing to the simulator.
+
+  std::vector<GPIOSimulator::LitPhase> phases;
+  simulator.Replay(&phases);
+  int frames = 0;
+  int64_t first = 0, last = 0, lit = 0;
+  for (size_t i = 0; i < phases.size(); ++i) {
+    if (phases[i].double_row == 0 && phases[i].plane == 0) {
+      if (frames++ == 0) first = phases[i].start_nanos;
+      last = phases[i].start_nanos;
+    }
+  }
+  for (size_t i = 0; i < phases.size(); ++i) {
+    if (phases[i].start_nanos >= first && phases[i].start_nanos < last)
+      lit += phases[i].duration_nanos;
+  }
+  printf("%-10s: %llu writes, ", pipelined ? "pipelined" : "serial",
+         (unsigned long long) simulator.total_writes());
+  if (frames < 2) {
+    printf("not enough frames recorded.\n");
+    return false;
+  }
+  printf("%7.1f Hz, %5.1f%% duty\n",
+         1e9 * (frames - 1) / (last - first), 100.0 * lit / (last - first));
+  printf("  stats: %llu frames, period min/p50/p99/max %.2f/%.2f/%.2f/%.2f ms,"
+         " %.1f%% duty\n", (unsigned long long) stats.frames,
+         stats.min_period / 1e6, stats.p50_period / 1e6,
+         stats.p99_period / 1e6, stats.max_period / 1e6,
+         100 * stats.duty_cycle);
+  printf("  avg plane overshoot (usec):");
+  for (int p = RefreshStats::kMaxPlanes - kPwmBits;
+       p < RefreshStats::kMaxPlanes; ++p) {
+    printf(" %.1f", stats.avg_plane_overshoot[p] / 1e3);
+  }
+  printf("\n");
+
+  // Every plane exactly as encoded.
+  bool ok = true;
+  std::vector<uint8_t> shown(width * height * 3);
+  for (int p = 0; p < kPwmBits; ++p) {
+    if (!simulator.ReconstructPlane(p, &shown[0])) {
+      printf("  plane %d: not shown\n", p);
+      ok = false;
+      continue;
+    }
+    int wrong = 0;
+    for (int i = 0; i < width * height * 3; ++i) {
+      if ((shown[i] != 0) != ((image[i] >> p) & 1)) ++wrong;
+    }
+    if (wrong) {
+      printf("  plane %d: %d wrong subpixels\n", p, wrong);
+      ok = false;
+    }
+  }
+
+  // The on-times give the brightness.
+  if (simulator.ReconstructImage(&shown[0])) {
+    int max_error = 0;
+    int64_t sum_error = 0;
+    for (int i = 0; i < width * height * 3; ++i) {
+      const int error = abs(shown[i] - image[i]);
+      max_error = std::max(max_error, error);
+      sum_error += error;
+    }
+    printf("  perceived brightness deviation: mean %.1f, max %d of 255\n",
+           1.0 * sum_error / (width * height * 3), max_error);
+  }
+  return ok;
+}
+
+// Each refresh shows another rounding of the colors to the planes we
+// have. With a linear curve, the values shown over a whole dither cycle
+// have to add up to exactly the color at the precision dithering promises.
+static bool CheckDithering(bool pipelined, int rows, int chain, int parallel,
+                           const uint8_t *image) {
+  const int width = 32 * chain;
+  const int height = rows * parallel;
+  const int phases = 1 << kDitherBits;
+  // Room for a few refreshes more than a dither cycle.
+  GPIOSimulator simulator((phases + 4) * (rows / 2) * kDitherPwmBits
+                          * (3 * width + 16));
+  RGBMatrix *matrix = new RGBMatrix(NULL, rows, chain, parallel);
+  matrix->SetPWMBits(kDitherPwmBits);
+  matrix->SetDitherBits(kDitherBits);
+  matrix->set_luminance_correct(false);
+  matrix->set_pipelined_output(pipelined);
+  matrix->SetPixels(0, 0, width, height, image, width * 3);
+  matrix->SetSimulator(&simulator);
+  matrix->WaitForRefreshes(phases + 2);
+  delete matrix;
+
+  std::vector<GPIOSimulator::LitPhase> lit;
+  simulator.Replay(&lit);
+  std::vector<size_t> starts;   // Where each refresh begins.
+  for (size_t i = 0; i < lit.size(); ++i) {
+    if (lit[i].double_row == 0 && lit[i].plane == 0) starts.push_back(i);
+  }
+  printf("dithering %d+%d bits, %-9s: ", kDitherPwmBits, kDitherBits,
+         pipelined ? "pipelined" : "serial");
+  if ((int) starts.size() <= phases) {
+    printf("not enough refreshes recorded\n");
+    return false;
+  }
+
+  // Add up the last whole cycle; the last refresh might be cut short.
+  std::vector<int> sum(width * height * 3);
+  for (size_t i = starts[starts.size() - 1 - phases]; i < starts.back(); ++i) {
+    const GPIOSimulator::LitPhase &phase = lit[i];
+    for (int sub_panel = 0; sub_panel < 2 * parallel; ++sub_panel) {
+      int *out = &sum[3 * width * (phase.double_row + sub_panel * rows / 2)];
+      for (int x = 0; x < width; ++x) {
+        for (int c = 0; c < 3; ++c, ++out) {
+          if (phase.colors[x] & (1 << (3 * sub_panel + c)))
+            *out += 1 << phase.plane;
+        }
+      }
+    }
+  }
+  const int max_value = ((1 << kDitherPwmBits) - 1) << kDitherBits;
+  int wrong = 0;
+  for (int i = 0; i < width * height * 3; ++i) {
+    if (sum[i] != lround(image[i] * max_value / 255.0)) ++wrong;
+  }
+  if (wrong)
+    printf("%d wrong subpixels\n", wrong);
+  else
+    printf("ok\n");
+  return wrong == 0;
+}
+
+// A scroll window larger than the display in both directions, at an offset
+// where the shown part wraps around horizontally and vertically: every
+// plane has to show the window content at the offset.
+static bool CheckScrollWindow(bool pipelined, int rows, int chain,
+                              int parallel) {
+  const int width = 32 * chain;
+  const int height = rows * parallel;
+  const int virtual_width = width + 37;
+  const int virtual_height = height + 23;
+  const int scroll_x = virtual_width - 5;
+  const int scroll_y = virtual_height - 7;
+  std::vector<uint8_t> image(virtual_width * virtual_height * 3);
+  for (size_t i = 0; i < image.size(); ++i) image[i] = random();
+
+  GPIOSimulator simulator;
+  RGBMatrix *matrix = new RGBMatrix(NULL, rows, chain, parallel);
+  matrix->SetPWMBits(kPwmBits);
+  matrix->set_luminance_correct(false);
+  matrix->set_pipelined_output(pipelined);
+  FrameCanvas *window = matrix->CreateScrollCanvas(virtual_width,
+                                                   virtual_height);
+  window->SetPixels(0, 0, virtual_width, virtual_height, &image[0],
+                    virtual_width * 3);
+  window->SetScrollOffset(scroll_x, scroll_y);
+  matrix->SwapOnVSync(window);
+  matrix->SetSimulator(&simulator);
+  matrix->WaitForRefreshes(2);
+  delete matrix;
+
+  int wrong = 0;
+  bool shown = true;
+  std::vector<uint8_t> plane(width * height * 3);
+  for (int p = 0; p < kPwmBits && shown; ++p) {
+    shown = simulator.ReconstructPlane(p, &plane[0]);
+    for (int y = 0; y < height && shown; ++y) {
+      const int vy = (y + scroll_y) % virtual_height;
+      for (int x = 0; x < width; ++x) {
+        const int vx = (x + scroll_x) % virtual_width;
+        for (int c = 0; c < 3; ++c) {
+          const uint8_t value = image[3 * (vy * virtual_width + vx) + c];
+          if ((plane[3 * (y * width + x) + c] != 0) != ((value >> p) & 1))
+            ++wrong;
+        }
+      }
+    }
+  }
+  printf("scroll window %dx%d, %d parallel, %-9s: ", virtual_width,
+         virtual_height, parallel, pipelined ? "pipelined" : "serial");
+  if (!shown)
+    printf("not all planes shown\n");
+  else if (wrong)
+    printf("%d wrong subpixels\n", wrong);
+  else
+    printf("ok\n");
+  return shown && wrong == 0;
+}
+
+int main(int argc, char *argv[]) {
+  const int chain = argc > 1 ? atoi(argv[1]) : 4;
+  const int millis = argc > 2 ? atoi(argv[2]) : 500;
+  const int parallel = argc > 3 ? atoi(argv[3]) : 1;
+  const int rows = argc > 4 ? atoi(argv[4]) : 32;
+  if (chain < 1 || millis < 1 || parallel < 1 || parallel > 3
+      || (rows != 16 && rows != 32 && rows != 64)) {
+    fprintf(stderr, "usage: %s [<chain> [<ms> [<parallel> [<rows>]]]]\n",
+            argv[0]);
+    return 1;
+  }
+  const int width = 32 * chain;
+  const int height = rows * parallel;
+  uint8_t *image = new uint8_t[width * height * 3];
+  for (int i = 0; i < width * height * 3; ++i) image[i] = random();
+
+  printf("%dx%d pixels (%d parallel), %d bitplanes, %d ms each\n",
+         width, height, parallel, kPwmBits, millis);
+  bool ok = Run(false, rows, chain, parallel, millis, image)
+    & Run(true, rows, chain, parallel, millis, image);
+  ok &= CheckDithering(false, rows, chain, parallel, image);
+  ok &= CheckDithering(true, rows, chain, parallel, image);
+  for (int n = 1; n <= 3; ++n) {
+    ok &= CheckScrollWindow(false, rows, chain, n);
+    ok &= CheckScrollWindow(true, rows, chain, n);
+  }
+  printf("%s\n", ok ? "Output verified." : "OUTPUT MISMATCH");
+  delete [] image;
+  return ok ? 0 : 1;
+}
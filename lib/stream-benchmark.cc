@@ -0,0 +1,167 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Measures how compact recordings are and how fast they are written and
+// played back, with content typical for a sign: a static background and a
+// scrolling ticker. Or plays a recording as fast as possible. Doesn't need
+// GPIO access, so it can run on any Linux box.
+//
+//   make -C lib stream-benchmark
+//   lib/stream-benchmark [<chain> [<frames>]]
+//   lib/stream-benchmark <recording>
+
+#include "led-matrix.h"
+#include "content-stream.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace rgb_matrix;
+
+static double Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Gradient background, a ticker of pseudo-random glyph pixels moving one
+// column per frame in the middle half and a blinking dot in the corner.
+static void DrawFrame(int f, int width, int height, uint8_t *rgb) {
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x, rgb += 3) {
+      rgb[0] = 0;
+      rgb[1] = 0;
+      rgb[2] = 4 * y;
+      if (y >= height / 4 && y < 3 * height / 4) {
+        const unsigned glyph = ((x + f) / 6) * 2654435761u;
+        if ((glyph >> ((x + f) % 6 + 6 * (y % 5))) & 1) {
+          rgb[0] = 255;
+          rgb[1] = 160;
+        }
+      }
+      if (x < 2 && y < 2 && (f / 30) % 2) rgb[0] = 255;
+    }
+  }
+}
+
+// Play as fast as possible, just decoding and onto a canvas.
+static int Play(int fd, FrameCanvas *canvas) {
+  StreamReader reader(fd);
+  if (!reader.ok()) {
+    fprintf(stderr, "Not a recording.\n");
+    return 1;
+  }
+  printf("%dx%d pixels\n", reader.width(), reader.height());
+  int64_t timestamp = 0;
+  int frames = 0;
+  double start = Now();
+  while (reader.ReadFrame(&timestamp)) ++frames;
+  double duration = Now() - start;
+  if (frames == 0) {
+    fprintf(stderr, "No frames.\n");
+    return 1;
+  }
+  printf("%d frames, %.1f seconds recorded\n", frames, timestamp / 1e6);
+  printf("decode           : %8.1f usec/frame %8.1f fps\n",
+         1e6 * duration / frames, frames / duration);
+
+  StreamPlayer player(&reader, false);
+  player.Rewind();
+  start = Now();
+  while (player.ShowNext(canvas)) {}
+  duration = Now() - start;
+  printf("play (no pacing) : %8.1f usec/frame %8.1f fps\n",
+         1e6 * duration / frames, frames / duration);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  const int rows = 32;
+  if (argc > 1 && atoi(argv[1]) == 0) {
+    const int fd = open(argv[1], O_RDONLY);
+    if (fd < 0) {
+      perror(argv[1]);
+      return 1;
+    }
+    StreamReader probe(fd);
+    RGBMatrix matrix(NULL, probe.ok() ? probe.height() : rows,
+                     probe.ok() ? probe.width() / 32 : 1);
+    lseek(fd, 0, SEEK_SET);
+    return Play(fd, matrix.CreateFrameCanvas());
+  }
+
+  const int chain = argc > 1 ? atoi(argv[1]) : 8;
+  const int frames = argc > 2 ? atoi(argv[2]) : 1000;
+  const int width = 32 * chain;
+  if (chain < 1 || frames < 1) {
+    fprintf(stderr, "usage: %s [<chain> [<frames>]]\n"
+            "       %s <recording>\n", argv[0], argv[0]);
+    return 1;
+  }
+
+  char filename[] = "/tmp/stream-benchmark-XXXXXX";
+  const int fd = mkstemp(filename);
+  if (fd < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  unlink(filename);
+
+  uint8_t *const image = new uint8_t[width * rows * 3];
+  double writing = 0;
+  StreamWriter writer(fd, width, rows);
+  for (int f = 0; f < frames; ++f) {
+    DrawFrame(f, width, rows, image);
+    const double start = Now();
+    writer.AppendFrame(image, 3 * width, f * 16667LL);
+    writing += Now() - start;
+  }
+  printf("%dx%d pixels, %d frames of a ticker\n", width, rows, frames);
+  printf("stream           : %8.1f bytes/frame (%.1f%% of raw)\n",
+         1.0 * writer.bytes_written() / frames,
+         100.0 * writer.bytes_written() / frames / (width * rows * 3));
+  printf("write            : %8.1f usec/frame\n", 1e6 * writing / frames);
+
+  // The same through the recorder, as the matrix does it: the time the
+  // caller spends is what counts.
+  const int null_fd = open("/dev/null", O_WRONLY);
+  int dropped = 0;
+  {
+    StreamRecorder recorder(null_fd, width, rows);
+    double handover = 0;
+    for (int f = 0; f < frames; ++f) {
+      DrawFrame(f, width, rows, image);
+      const double start = Now();
+      recorder.AddFrame(image, 3 * width);
+      handover += Now() - start;
+      usleep(1000);
+    }
+    printf("record hand-over : %8.1f usec/frame\n", 1e6 * handover / frames);
+    dropped = recorder.dropped_frames();
+  }
+  close(null_fd);
+  printf("                   %d frames dropped\n", dropped);
+
+  RGBMatrix matrix(NULL, rows, chain);
+  lseek(fd, 0, SEEK_SET);
+  const int result = Play(fd, matrix.CreateFrameCanvas());
+  close(fd);
+  delete [] image;
+  return result;
+}
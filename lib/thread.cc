@@ -15,20 +15,35 @@
 
 #include "thread.h"
 
+#include <assert.h>
+#include <errno.h>
 #include <sched.h>
 #include <stdio.h>
 #include <string.h>
-#include <assert.h>
+#include <sys/mman.h>
 
 namespace rgb_matrix {
 void *Thread::PthreadCallRun(void *tobject) {
-  reinterpret_cast<Thread*>(tobject)->Run();
+  Thread *thread = reinterpret_cast<Thread*>(tobject);
+  pthread_mutex_lock(&thread->start_mutex_);
+  while (!thread->may_run_) {
+    pthread_cond_wait(&thread->start_cond_, &thread->start_mutex_);
+  }
+  pthread_mutex_unlock(&thread->start_mutex_);
+  thread->Run();
   return NULL;
 }
 
-Thread::Thread() : started_(false) {}
+Thread::Thread() : started_(false), may_run_(false) {
+  memset(&status_, 0, sizeof(status_));
+  status_.cpu = -1;
+  pthread_mutex_init(&start_mutex_, NULL);
+  pthread_cond_init(&start_cond_, NULL);
+}
 Thread::~Thread() {
   WaitStopped();
+  pthread_cond_destroy(&start_cond_);
+  pthread_mutex_destroy(&start_mutex_);
 }
 
 void Thread::WaitStopped() {
@@ -41,16 +56,81 @@ void Thread::WaitStopped() {
 }
 
 void Thread::Start(int priority) {
+  ThreadOptions options;
+  if (priority > 0) {
+    options.policy = SCHED_FIFO;
+    options.priority = priority;
+  }
+  Start(options);
+}
+
+void Thread::Failed(const char *what, int error) {
+  fprintf(stderr, "Thread: %s failed: %s\n", what, strerror(error));
+  if (status_.failed == NULL) {
+    status_.failed = what;
+    status_.error = error;
+  }
+}
+
+bool Thread::Start(const ThreadOptions &options) {
   assert(!started_);
-  pthread_create(&thread_, NULL, &PthreadCallRun, this);
+  memset(&status_, 0, sizeof(status_));
 
-  if (priority > 0) {
-    struct sched_param p;
-    p.sched_priority = priority;
-    pthread_setschedparam(thread_, SCHED_FIFO, &p);
+  // Before the thread exists, so that its stack is locked as well.
+  if (options.lock_memory) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0)
+      status_.memory_locked = true;
+    else
+      Failed("mlockall", errno);
   }
 
+  may_run_ = false;
+  int result = pthread_create(&thread_, NULL, &PthreadCallRun, this);
+  if (result != 0) {
+    Failed("pthread_create", result);
+    return false;
+  }
   started_ = true;
+
+  // The thread waits for us, so all of this is in place before Run().
+  if (options.name != NULL) {
+    result = pthread_setname_np(thread_, options.name);
+    if (result != 0) Failed("pthread_setname_np", result);
+  }
+  if (options.cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(options.cpu, &cpus);
+    result = pthread_setaffinity_np(thread_, sizeof(cpus), &cpus);
+    if (result != 0) Failed("pthread_setaffinity_np", result);
+  }
+  if (options.policy != SCHED_OTHER) {
+    struct sched_param p;
+    p.sched_priority = options.priority;
+    result = pthread_setschedparam(thread_, options.policy, &p);
+    if (result != 0) Failed("pthread_setschedparam", result);
+  }
+
+  // Find out what we actually got.
+  struct sched_param p;
+  if (pthread_getschedparam(thread_, &status_.policy, &p) == 0)
+    status_.priority = p.sched_priority;
+  cpu_set_t cpus;
+  status_.cpu = -1;
+  if (pthread_getaffinity_np(thread_, sizeof(cpus), &cpus) == 0
+      && CPU_COUNT(&cpus) == 1) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &cpus)) status_.cpu = cpu;
+    }
+  }
+  pthread_getname_np(thread_, status_.name, sizeof(status_.name));
+  status_.started = true;
+
+  pthread_mutex_lock(&start_mutex_);
+  may_run_ = true;
+  pthread_cond_signal(&start_cond_);
+  pthread_mutex_unlock(&start_mutex_);
+  return status_.failed == NULL;
 }
 
 }  // namespace rgb_matrix
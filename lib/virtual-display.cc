@@ -0,0 +1,270 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2026 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+#include "virtual-display.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace rgb_matrix {
+static int64_t GetNanos(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void AppendColor(std::string *out, int layer, const uint8_t *rgb) {
+  char escape[24];
+  snprintf(escape, sizeof(escape), "\033[%d;2;%d;%d;%dm",
+           layer, rgb[0], rgb[1], rgb[2]);
+  out->append(escape);
+}
+
+// Whether "pattern" has exactly one conversion, an int like %d or %05d,
+// besides any %%, so that it can be handed to snprintf() with the frame
+// number.
+static bool IsFramePattern(const char *pattern) {
+  int conversions = 0;
+  for (const char *p = pattern; *p; ++p) {
+    if (*p != '%') continue;
+    if (*++p == '%') continue;
+    while (*p && strchr("-+ #0", *p)) ++p;
+    while (isdigit(*p)) ++p;
+    if (*p != 'd') return false;
+    ++conversions;
+  }
+  return conversions == 1;
+}
+
+static inline bool SamePixel(const uint8_t *a, const uint8_t *b) {
+  return a[0] == b[0] && a[1] == b[1] && a[2] == b[2];
+}
+
+VirtualDisplay::VirtualDisplay(int fd, Output output, int fps)
+  : fd_(fd), output_(output) {
+  Init(fps);
+}
+
+VirtualDisplay::VirtualDisplay(const char *pattern, int fps)
+  : fd_(-1), output_(kPPM), pattern_(pattern) {
+  Init(fps);
+  if (!IsFramePattern(pattern))
+    ok_ = false;
+}
+
+void VirtualDisplay::Init(int fps) {
+  fps_ = fps > 0 ? fps : 30;
+  width_ = height_ = 0;
+  ok_ = true;
+  next_due_ = 0;
+  terminal_lines_ = 0;
+  memset(&window_, 0, sizeof(window_));
+  memset(&start_, 0, sizeof(start_));
+  memset(&current_, 0, sizeof(current_));
+  for (int i = 0; i < 4096; ++i) {
+    const double linear = (i << 4 | i >> 8) / 65535.0;
+    const double srgb = (linear <= 0.0031308)
+      ? 12.92 * linear : 1.055 * pow(linear, 1 / 2.4) - 0.055;
+    srgb_[i] = lround(255 * srgb);
+  }
+}
+
+VirtualDisplay::~VirtualDisplay() {
+  if (output_ == kTerminal && terminal_lines_ > 0 && ok_) {
+    Write(fd_, "\033[0m\033[?25h");   // Colors back to normal, cursor on.
+  }
+}
+
+void VirtualDisplay::Configure(int width, int height) {
+  width_ = width;
+  height_ = height;
+  frame_.assign(3 * width * height, 0);
+  previous_.clear();
+}
+
+bool VirtualDisplay::ShowFrame(const uint16_t *lit) {
+  if (!ok_) return false;
+  for (size_t i = 0; i < frame_.size(); ++i) {
+    frame_[i] = srgb_[lit[i] >> 4];
+  }
+  const bool changed = (frame_ != previous_);
+  if (changed) previous_ = frame_;
+  if (next_due_ == 0) {   // First frame: the stats start here.
+    MutexLock l(&mutex_);
+    SnapshotStats(&start_);
+    current_ = window_ = start_;
+  }
+
+  WaitForFrame();
+  if (output_ == kTerminal)
+    RenderTerminal(&frame_[0], changed);
+  else
+    RenderPPM(&frame_[0]);
+
+  Stats now;
+  SnapshotStats(&now);
+  MutexLock l(&mutex_);
+  now.frames = current_.frames + 1;
+  now.changed_frames = current_.changed_frames + (changed ? 1 : 0);
+  current_ = now;
+  return ok_;
+}
+
+void VirtualDisplay::WaitForFrame() {
+  const int64_t period = 1000000000LL / fps_;
+  const int64_t now = GetNanos(CLOCK_MONOTONIC);
+  if (next_due_ == 0 || now > next_due_ + period) {
+    next_due_ = now;   // First frame, or way behind: don't catch up.
+  } else if (now < next_due_) {
+    struct timespec due;
+    due.tv_sec = next_due_ / 1000000000;
+    due.tv_nsec = next_due_ % 1000000000;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL)
+           == EINTR) {}
+  }
+  next_due_ += period;
+}
+
+// Each character cell shows two pixels: the upper half block in the
+// foreground color, the lower half in the background color. Colors are
+// only sent when they change from one cell to the next.
+void VirtualDisplay::RenderTerminal(const uint8_t *rgb, bool changed) {
+  // Once a second, the status line gets the rates of the last second.
+  if (current_.seconds - window_.seconds >= 1) {
+    Stats last;
+    Difference(current_, window_, &last);
+    status_ = FormatStats(last);
+    window_ = current_;
+    changed = true;
+  }
+  if (!changed && terminal_lines_ > 0)
+    return;
+
+  out_.clear();
+  if (terminal_lines_ > 0) {
+    char up[16];
+    snprintf(up, sizeof(up), "\033[%dA\r", terminal_lines_);
+    out_.append(up);
+  } else {
+    out_.append("\033[?25l");   // Cursor off, it would flicker.
+  }
+  const int stride = 3 * width_;
+  for (int y = 0; y < height_; y += 2) {
+    const uint8_t *upper = rgb + y * stride;
+    const uint8_t *lower = (y + 1 < height_) ? upper + stride : NULL;
+    const uint8_t *fg = NULL, *bg = NULL;
+    for (int x = 0; x < width_; ++x, upper += 3) {
+      if (fg == NULL || !SamePixel(fg, upper)) {
+        AppendColor(&out_, 38, upper);
+        fg = upper;
+      }
+      if (lower != NULL) {
+        if (bg == NULL || !SamePixel(bg, lower)) {
+          AppendColor(&out_, 48, lower);
+          bg = lower;
+        }
+        lower += 3;
+      }
+      out_.append("\xe2\x96\x80");   // Upper half block.
+    }
+    out_.append("\033[0m\n");
+  }
+  out_.append(status_);
+  out_.append("\033[K\n");
+  terminal_lines_ = (height_ + 1) / 2 + 1;
+  Write(fd_, out_);
+}
+
+void VirtualDisplay::RenderPPM(const uint8_t *rgb) {
+  char header[32];
+  snprintf(header, sizeof(header), "P6\n%d %d\n255\n", width_, height_);
+  out_.assign(header);
+  out_.append((const char *) rgb, 3 * width_ * height_);
+  if (pattern_.empty()) {
+    Write(fd_, out_);
+    return;
+  }
+  char filename[1024];
+  snprintf(filename, sizeof(filename), pattern_.c_str(),
+           (int) current_.frames);
+  const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    ok_ = false;
+    return;
+  }
+  Write(fd, out_);
+  close(fd);
+}
+
+bool VirtualDisplay::Write(int fd, const std::string &data) {
+  size_t done = 0;
+  while (ok_ && done < data.size()) {
+    const ssize_t w = write(fd, data.data() + done, data.size() - done);
+    if (w < 0 && errno == EINTR) continue;
+    if (w <= 0) ok_ = false;
+    else done += w;
+  }
+  return ok_;
+}
+
+// Times so far; the frame counts are kept in current_.
+void VirtualDisplay::SnapshotStats(Stats *stats) const {
+  const int64_t thread_cpu = GetNanos(CLOCK_THREAD_CPUTIME_ID);
+  stats->frames = current_.frames;
+  stats->changed_frames = current_.changed_frames;
+  stats->seconds = GetNanos(CLOCK_MONOTONIC) / 1e9;
+  stats->display_cpu = thread_cpu / 1e9;
+  stats->other_cpu =
+    (GetNanos(CLOCK_PROCESS_CPUTIME_ID) - thread_cpu) / 1e9;
+}
+
+void VirtualDisplay::Difference(const Stats &later, const Stats &earlier,
+                                Stats *result) {
+  result->frames = later.frames - earlier.frames;
+  result->changed_frames = later.changed_frames - earlier.changed_frames;
+  result->seconds = later.seconds - earlier.seconds;
+  result->display_cpu = later.display_cpu - earlier.display_cpu;
+  result->other_cpu = later.other_cpu - earlier.other_cpu;
+}
+
+void VirtualDisplay::GetStats(Stats *stats) const {
+  MutexLock l(&mutex_);
+  Difference(current_, start_, stats);
+}
+
+void VirtualDisplay::PrintStats(FILE *out) const {
+  Stats stats;
+  GetStats(&stats);
+  fprintf(out, "%s\n", FormatStats(stats).c_str());
+}
+
+std::string VirtualDisplay::FormatStats(const Stats &stats) {
+  const double seconds = stats.seconds > 0 ? stats.seconds : 1;
+  char line[160];
+  snprintf(line, sizeof(line),
+           "%.1f fps, %.1f changed/s; CPU: %.2f ms/frame display, "
+           "%.2f ms/changed frame drawing",
+           stats.frames / seconds, stats.changed_frames / seconds,
+           stats.frames > 0 ? 1e3 * stats.display_cpu / stats.frames : 0.0,
+           stats.changed_frames > 0
+           ? 1e3 * stats.other_cpu / stats.changed_frames : 0.0);
+  return line;
+}
+}  // namespace rgb_matrix
@@ -433,8 +433,8 @@ static int usage(const char *progname) {
   fprintf(stderr, "usage: %s <options> -D <demo-nr> [optional parameter]\n",
           progname);
   fprintf(stderr, "Options:\n"
-          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32. "
-          "Default: 32\n"
+          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32, 64 for\n"
+          "\t                64x64 (which count as 2 chained). Default: 32\n"
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
           "\t-L            : 'Large' display, composed out of 4 times 32x32\n"
           "\t-p <pwm-bits> : Bits used for PWM. Something between 1..11\n"
@@ -532,8 +532,8 @@ int main(int argc, char *argv[]) {
     return usage(argv[0]);
   }
 
-  if (rows != 16 && rows != 32) {
-    fprintf(stderr, "Rows can either be 16 or 32\n");
+  if (rows != 16 && rows != 32 && rows != 64) {
+    fprintf(stderr, "Rows can either be 16, 32 or 64\n");
     return 1;
   }
 
@@ -107,9 +107,9 @@ static PyObject *SetPixel(RGBmatrixObject *self, PyObject *arg) {
 // Copy whole display buffer to display from a list of bytes [R1,G1,B1,R2,G2,B2...]
 static PyObject *SetBuffer(RGBmatrixObject *self, PyObject *data) 
 {
-	Py_ssize_t count;
-	int        w, h, offset, y, x;
-	uint8_t    r, g, b;
+	Py_ssize_t count, i;
+	int        w, h;
+	uint8_t   *rgb;
 
 	count = PyList_Size(data);
 
@@ -122,17 +122,15 @@ static PyObject *SetBuffer(RGBmatrixObject *self, PyObject *data)
 		return NULL;
 	}
 
-	for(y=0; y<h; y++) 
+	// Collect into a plain RGB buffer, then hand it over in one call
+	// instead of setting pixel by pixel.
+	rgb = new uint8_t[count];
+	for(i=0; i<count; i++)
 	{
-		for(x=0; x<w; x++) 
-		{
-			offset = (y*w*3)+(x*3);
-			r = PyInt_AsLong(PyList_GetItem(data, offset));
-			g = PyInt_AsLong(PyList_GetItem(data, offset+1));
-			b = PyInt_AsLong(PyList_GetItem(data, offset+2));
-			self->matrix->SetPixel(x, y, r, g, b);
-		}
+		rgb[i] = PyInt_AsLong(PyList_GetItem(data, i));
 	}
+	self->matrix->SetPixels(0, 0, w, h, rgb, w*3);
+	delete [] rgb;
 
 	Py_INCREF(Py_None);
 	return Py_None;
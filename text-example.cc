@@ -21,8 +21,8 @@ static int usage(const char *progname) {
           "Empty string: clear screen\n");
   fprintf(stderr, "Options:\n"
           "\t-f <font-file>: Use given font.\n"
-          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32. "
-          "Default: 32\n"
+          "\t-r <rows>     : Display rows. 16 for 16x32, 32 for 32x32, 64 for\n"
+          "\t                64x64 (which count as 2 chained). Default: 32\n"
           "\t-c <chained>  : Daisy-chained boards. Default: 1.\n"
           "\t-x <x-origin> : X-Origin of displaying text (Default: 0)\n"
           "\t-y <y-origin> : Y-Origin of displaying text (Default: 0)\n"